@@ -31,6 +31,7 @@
 #define _MIPS_VM_H_
 
 #include <lib.h>
+#include <machine/atomic.h>
 
 
 /*
@@ -135,10 +136,8 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;		/* page to invalidate, 0 flushes the whole TLB */
+	atomic_t *ts_done;		/* incremented by the target once handled */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -40,6 +40,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <proc.h>
 
 
 /* in exception-*.S */
@@ -109,6 +110,12 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr, int cause)
 		break;
 	}
 
+#if OPT_SYSCALLS
+	/* the fault failed because the process was chosen by the OOM killer */
+	if (curproc->p_killed)
+		sig = SIGKILL;
+#endif // OPT_SYSCALLS
+
 	/*
 	 * You will probably want to change this.
 	 */
@@ -323,6 +330,16 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#if OPT_SYSCALLS
+	/*
+	 * Killed by the OOM killer or by another thread
+	 * of the process, don't go back to userland.
+	 */
+	if (!iskern && (curproc->p_killed || curproc->p_exiting)) {
+		sys__exit(_MKWAIT_SIG(SIGKILL));
+	}
+#endif // OPT_SYSCALLS
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -38,6 +38,7 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <slab.h>
 
 #define MAKE_64BIT(x, y) ((uint64_t)(x) << 32 | (y))
 #define GET_LO(x)        ((uint32_t)( (x) & 0x00000000ffffffff))
@@ -85,6 +86,7 @@ void syscall(struct trapframe *tf)
 {
 	int callno;
 	int whence;
+	off_t offset;
 	int32_t retval;
 	uint64_t retval_64;
 	int err;
@@ -181,6 +183,22 @@ void syscall(struct trapframe *tf)
 	case SYS_fstat:
 		err = sys_fstat((int)tf->tf_a0, (userptr_t)tf->tf_a1);
 		break;
+
+	case SYS_thread_create:
+		err = sys_thread_create((userptr_t)tf->tf_a0,
+								(userptr_t)tf->tf_a1,
+								tf,
+								&retval);
+		break;
+
+	case SYS_thread_exit:
+		sys_thread_exit((int)tf->tf_a0);
+		panic("sys_thread_exit returned\n");
+		break;
+
+	case SYS_thread_join:
+		err = sys_thread_join((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
 #endif // OPT_SYSCALL
 
 #if OPT_SYSFS
@@ -198,6 +216,45 @@ void syscall(struct trapframe *tf)
 	case SYS_remove:
 		err = sys_remove((const_userptr_t)tf->tf_a0);
 		break;
+
+	case SYS_readv:
+		err = sys_readv((int)tf->tf_a0,
+						(const_userptr_t)tf->tf_a1,
+						(int)tf->tf_a2,
+						(size_t *)&retval);
+		break;
+
+	case SYS_writev:
+		err = sys_writev((int)tf->tf_a0,
+						(const_userptr_t)tf->tf_a1,
+						(int)tf->tf_a2,
+						(size_t *)&retval);
+		break;
+
+	case SYS_pread:
+		//the 64 bit offset is aligned on the stack at sp+16
+		err = copyin((const_userptr_t)tf->tf_sp + 16, &offset, sizeof(off_t));
+		if (err)
+			break;
+
+		err = sys_pread((int)tf->tf_a0,
+						(userptr_t)tf->tf_a1,
+						(size_t)tf->tf_a2,
+						offset,
+						(size_t *)&retval);
+		break;
+
+	case SYS_pwrite:
+		err = copyin((const_userptr_t)tf->tf_sp + 16, &offset, sizeof(off_t));
+		if (err)
+			break;
+
+		err = sys_pwrite((int)tf->tf_a0,
+						(const_userptr_t)tf->tf_a1,
+						(size_t)tf->tf_a2,
+						offset,
+						(size_t *)&retval);
+		break;
 #endif // OPT_SYSFS
 
 	default:
@@ -251,6 +308,8 @@ void syscall(struct trapframe *tf)
  *
  * Thus, you can trash it and do things another way if you prefer.
  */
+DEFINE_KMEM_CACHE(trapframe_cache, struct trapframe, NULL);
+
 void enter_forked_process(struct trapframe *tf)
 {
 	struct trapframe local;
@@ -261,7 +320,7 @@ void enter_forked_process(struct trapframe *tf)
 	 * causing a memory leak.
 	 */
 	memcpy(&local, tf, sizeof(struct trapframe));
-	kfree(tf);
+	kmem_cache_free(&trapframe_cache, tf);
 
 	/* Increase counter to avoid restarting the intrrupt */
 	local.tf_epc += 4;
@@ -273,3 +332,20 @@ void enter_forked_process(struct trapframe *tf)
 	mips_usermode(&local);
 	panic("returned from mips_usermode!\n");
 }
+
+/*
+ * Enter user mode for a thread created by thread_create(),
+ * the trapframe already holds the entry point, the argument
+ * and the stack of the thread.
+ */
+void enter_new_thread(struct trapframe *tf)
+{
+	struct trapframe local;
+
+	/* the trapframe comes from trapframe_cache, see above */
+	memcpy(&local, tf, sizeof(struct trapframe));
+	kmem_cache_free(&trapframe_cache, tf);
+
+	mips_usermode(&local);
+	panic("returned from mips_usermode!\n");
+}
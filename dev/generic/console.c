@@ -58,7 +58,9 @@
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
+#include <proc.h>
 #include "autoconf.h"
+#include "opt-syscalls.h"
 
 /*
  * The console device.
@@ -134,21 +136,47 @@ putch_intr(struct con_softc *cs, int ch)
 }
 
 /*
- * Read a character, using interrupts to wait for I/O completion.
+ * Take a character from the input buffer, the caller got it
+ * from cs_rsem.
  */
 static
 int
-getch_intr(struct con_softc *cs)
+getch_take(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	return ret;
 }
 
+/*
+ * Read a character, using interrupts to wait for I/O completion.
+ */
+static
+int
+getch_intr(struct con_softc *cs)
+{
+	P(cs->cs_rsem);
+	return getch_take(cs);
+}
+
+/*
+ * A user read gives up waiting for input when its process
+ * is being torn down, see con_interrupt().
+ */
+static
+bool
+con_read_interrupted(void)
+{
+#if OPT_SYSCALLS
+	return curproc != NULL && proc_stopping(curproc);
+#else
+	return false;
+#endif
+}
+
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
@@ -225,6 +253,20 @@ getch(void)
 	return getch_intr(cs);
 }
 
+/*
+ * Wake up the user reads waiting for input, so that they
+ * notice their process is being torn down.
+ */
+void
+con_interrupt(void)
+{
+	struct con_softc *cs = the_console;
+
+	if (cs != NULL) {
+		sem_wakeall(cs->cs_rsem);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -262,7 +304,13 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			result = P_interruptible(the_console->cs_rsem,
+						 con_read_interrupted);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
+			ch = getch_take(the_console);
 			if (ch=='\r') {
 				ch = '\n';
 			}
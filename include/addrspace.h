@@ -146,6 +146,42 @@ extern int as_define_args(struct addrspace *as, int argc, char **argv, userptr_t
 
 extern struct addrspace_area *as_find_area(struct addrspace *as, vaddr_t addr);
 
+#if OPT_PAGING
+extern int as_define_thread_stack(struct addrspace *as, vaddr_t *stackptr);
+
+extern void as_release_thread_stack(struct addrspace *as, vaddr_t stackptr);
+#endif // OPT_PAGING
+
+#if OPT_PAGING
+/*
+ * Position of a walk over all the address spaces,
+ * see as_walk_resume().
+ */
+struct as_cursor {
+        unsigned as_id;         /* address space to start from */
+        vaddr_t addr;           /* address to start from */
+        bool stopped;           /* set to stop the walk */
+};
+
+extern void as_bootstrap(void);
+
+extern int as_walk_all(vaddr_t start, vaddr_t end, walk_ops_t f, void *private);
+
+extern int as_walk_resume(struct as_cursor *cursor, walk_ops_t f, void *private);
+
+extern int as_walk_one(unsigned as_id, vaddr_t start, vaddr_t end, walk_ops_t f, void *private);
+
+extern size_t as_rss_limit(struct addrspace *as);
+
+extern void as_set_rss_limit(struct addrspace *as, size_t pages);
+
+extern int as_walk_over_limit(walk_ops_t f, void *private);
+
+extern int as_walk_coldest(walk_ops_t f, void *private);
+
+extern int as_for_each(void (*f)(struct addrspace *as, void *private), void *private);
+#endif // OPT_PAGING
+
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
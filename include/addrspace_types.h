@@ -28,6 +28,7 @@ typedef enum page_flags_t {
         PGF_ALLOC,      
         PGF_KERN,
         PGF_USER,
+        PGF_ISOLATED,   /* Free page taken out of the buddy allocator by the compaction */
 } page_flags_t;
 
 
@@ -45,6 +46,8 @@ struct page {
                 struct list_head buddy_list;
 
                 refcount_t      _mapcount;    /* User usage count, increased when a page becomes COW */
+
+                unsigned        pt_populated; /* Not none entries, when the page holds a PTE table */
         };
 
         /*
@@ -117,6 +120,11 @@ struct addrspace {
 #elif OPT_PAGING
         struct page_table pt;   /* Page table associate with an address space. */
 
+        struct lock  *pt_lock;                  /* Lock for the page table. */
+
+        struct list_head as_list;               /* Entry in the list of all address spaces. */
+        unsigned as_id;                         /* Creation order, never reused. */
+
         struct list_head addrspace_area_list;   /* List of memory areas. */
 
         struct lock  *as_file_lock;             /* Lock for the source file. */
@@ -124,6 +132,23 @@ struct addrspace {
         struct vnode *source_file;              /* Source file of the proc, NULL otherwise. */
 
         vaddr_t start_stack, end_stack;
+
+        /*
+         * Stack slots of the threads created by thread_create(),
+         * below the main stack, protected by `pt_lock`.
+         */
+        uint32_t thread_stacks;                 /* Slots in use by a thread. */
+        uint32_t thread_stacks_mapped;          /* Slots with an area. */
+
+        size_t rss_limit;                       /* Resident pages limit, 0 for a fair share. */
+
+        /*
+         * Working set estimate, updated by the sampler
+         * while holding `pt_lock`.
+         */
+        size_t wss_pages;                       /* Pages referenced recently. */
+        unsigned nr_faults;                     /* Page faults since the last sample. */
+        unsigned pff;                           /* Page faults in the last sampling period. */
 #endif // OPT_PAGING
 
 #if OPT_ARGS
@@ -11,6 +11,7 @@
 #include <vfs.h>
 #include <synch.h>
 
+struct iovec;
 
 struct file {
     int fd;
@@ -22,20 +23,61 @@ struct file {
     struct lock *file_lock;      /* struct file lock */
 };
 
+#define FD_MAP_BITS     (sizeof(uint32_t) * 8)
+
+/*
+ * Slots of the table embedded in every file table, enough
+ * for most processes, it grows geometrically up to the fd
+ * limit. FD_LIMIT_MAX bounds the limit set at runtime.
+ */
+#define FD_TABLE_INIT   (32)
+#define FD_LIMIT_MAX    (4096)
+
+struct fd_table {
+    unsigned max_fds;                   /* number of slots, multiple of FD_MAP_BITS */
+    uint32_t *open_fds;                 /* bitmap of the used fds */
+    struct file **fd_array;             /* open files, read without locking */
+    struct fd_table *old;               /* smaller table replaced by this one */
+};
+
 struct file_table {
+    refcount_t refcount;                /* processes sharing the table, copied on change */
     size_t open_files;                  /* counts the number of open files */
-    struct lock *table_lock;            /* locks the fd_array */
-    struct file *fd_array[OPEN_MAX];    /* linear array of open files */
+    struct lock *table_lock;            /* serializes the updates of the table */
+    struct fd_table *fdt;               /* current table */
+    struct fd_table fdtab;              /* first table, embedded */
+    uint32_t open_fds_init[FD_TABLE_INIT / FD_MAP_BITS];
+    struct file *fd_array_init[FD_TABLE_INIT];
 };
 
+extern unsigned file_fd_limit;
+
 
 extern struct file *file_create(void);
 
+extern void file_free(struct file *file);
+
 extern void file_destroy(struct file *file);
 
-extern int file_read(struct file *file, void *kbuf, size_t nbyte, size_t *byte_read);
+/*
+ * Drops the reference taken by `file_table_get`.
+ */
+static inline void file_put(struct file *file)
+{
+    file_destroy(file);
+}
+
+extern int file_read(struct file *file, userptr_t buf, size_t nbyte, size_t *byte_read);
+
+extern int file_write(struct file *file, const_userptr_t buf, size_t nbyte, size_t *byte_wrote);
+
+extern int file_pread(struct file *file, userptr_t buf, size_t nbyte, off_t offset, size_t *byte_read);
+
+extern int file_pwrite(struct file *file, const_userptr_t buf, size_t nbyte, off_t offset, size_t *byte_wrote);
 
-extern int file_write(struct file *file, void *kbuf, size_t nbyte, size_t *byte_wrote);
+extern int file_readv(struct file *file, struct iovec *iov, int iovcnt, size_t *byte_read);
+
+extern int file_writev(struct file *file, struct iovec *iov, int iovcnt, size_t *byte_wrote);
 
 extern int file_lseek(struct file *file, off_t offset, int whence, off_t *offset_location);
 
@@ -45,19 +87,34 @@ extern void file_add_offset(struct file *file, off_t offset);
 
 extern off_t file_read_offset(struct file *file);
 
-extern int file_next_fd(struct file_table *head);
+extern int file_set_fd_limit(unsigned limit);
+
+extern int file_table_alloc(struct file_table *ftable, struct file *file, int *fd);
 
 extern struct file_table *file_table_create(void);
 
 extern void file_table_destroy(struct file_table *ftable);
 
+extern struct file_table *file_table_share(struct file_table *ftable);
+
+extern void file_table_put(struct file_table *ftable);
+
+static inline bool file_table_shared(struct file_table *ftable)
+{
+    return refcount_read(&ftable->refcount) > 1;
+}
+
 extern int file_table_add(struct file *file, struct file_table *head);
 
 extern int file_table_remove(struct file_table *ftable, int fd);
 
+extern void file_console_bootstrap(void);
+
 extern int file_table_init(struct file_table *ftable);
 
-extern struct file *file_table_get(struct file_table *head, int fd);
+extern struct file *file_table_lookup(struct file_table *head, int fd);
+
+extern struct file *file_table_get(struct file_table *head, int fd, bool exclusive);
 
 extern int file_table_dup2(struct file_table *ftable, int oldfd, int newfd);
 
@@ -0,0 +1,10 @@
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include <types.h>
+
+extern void ksm_bootstrap(void);
+
+extern void ksm_print_info(void);
+
+#endif // _KSM_H_
@@ -126,10 +126,14 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_shrink gives the unused kernel heap pages back to the page
+ * allocator and returns how many were released.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+unsigned kheap_shrink(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
@@ -164,6 +168,7 @@ const char *strerror(int errcode);
  */
 void putch(int ch);
 int getch(void);
+void con_interrupt(void);
 void beep(void);
 
 /*
@@ -0,0 +1,14 @@
+#ifndef _OOM_H_
+#define _OOM_H_
+
+#include <types.h>
+
+extern int oom_kill_process(void);
+
+extern void oom_wakeup(void);
+
+extern void oom_timerclock(void);
+
+extern void oom_bootstrap(void);
+
+#endif // _OOM_H_
@@ -47,6 +47,29 @@ static inline bool user_page_put(struct page *page)
     return destroy;
 }
 
+/**
+ * @brief Same as user_page_put(), but when the usage count
+ * drops to 0 the page is queued on `free_list` instead of
+ * being freed. The list is released with free_pages_list().
+ * 
+ * @param page page being put away
+ * @param free_list list of pages to be freed
+ * @return true when the page is queued
+ */
+static inline bool user_page_put_deferred(struct page *page, struct list_head *free_list)
+{
+    bool destroy;
+
+    KASSERT(page->flags == PGF_USER);
+
+    destroy = refcount_dec(&page->_mapcount) == 0;
+
+    if (destroy)
+        list_add_tail(&page->buddy_list, free_list);
+
+    return destroy;
+}
+
 static inline struct page *user_page_copy(struct page *page)
 {
     struct page *new_page;
@@ -73,7 +96,7 @@ static inline struct page *user_page_copy(struct page *page)
     if (!new_page)
         return NULL;
 
-    memcpy((void *)page_to_kvaddr(new_page), (void *)page_to_kvaddr(page), PAGE_SIZE);
+    copy_page(new_page, page);
 
     refcount = refcount_dec(&page->_mapcount);
 
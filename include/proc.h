@@ -40,6 +40,8 @@
 #include <types.h>
 #include <limits.h>
 #include <synch.h>
+#include <wchan.h>
+#include <rwonce.h>
 #include <file.h>
 #include "opt-syscalls.h"
 #include "opt-sysfs.h"
@@ -54,6 +56,23 @@ struct addrspace;
 struct thread;
 struct vnode;
 
+#if OPT_SYSCALLS
+/**
+ * @brief User thread created by thread_create(), the
+ * record outlives the kernel thread until it's joined.
+ * Protected by the p_lock of the process.
+ *
+ */
+struct uthread {
+	int ut_tid;			/* id of the thread inside the process */
+	struct list_head ut_list;	/* entry in proc->p_uthreads */
+	vaddr_t ut_stack;		/* top of the user stack */
+	bool ut_exited;			/* the thread called thread_exit() */
+	bool ut_joining;		/* a thread is waiting for it */
+	int ut_status;			/* value passed to thread_exit() */
+};
+#endif // OPT_SYSCALLS
+
 /*
  * Process structure.
  *
@@ -83,16 +102,20 @@ struct proc {
 	struct vnode *p_cwd;		/* current working directory */
 
 #if OPT_SYSCALLS
-	/* waitpid cv */
-	struct cv *wait_cv;
-	/* waitpid lock */
-	struct lock *wait_lock;
 	/*
-	 * Used after the the proc becomes zombie,
-	 * if it doesn't call this the proces
-	 * may be free to early by sys_waitpid
+	 * The parent sleeps here in waitpid, the threads of the
+	 * proc in thread_join() and _exit(), protected by p_lock.
+	 * `exit_code`, `exit_state` and `state` are published
+	 * together under p_lock, once the proc is ZOMBIE the
+	 * exiting thread doesn't touch it anymore.
 	 */
-	struct semaphore *wait_sem;
+	struct wchan p_wchan;
+
+	/* threads created by thread_create(), p_lock */
+	struct list_head p_uthreads;
+	int p_next_tid;
+	/* a thread is tearing down the others, see proc_stop_threads() */
+	bool p_exiting;
 
 	proc_state_t state;
 	proc_state_t exit_state;
@@ -108,10 +131,13 @@ struct proc {
 	/* Recipient of SIGCHLD */
 	struct proc *parent;
 
+	/* a thread of the parent is waiting for it, parent p_lock */
+	bool p_waited;
+
 	pid_t pid;
 
-	/* PID hash table linkage */
-	struct hlist_node pid_link;
+	/* Chosen by the OOM killer, exits before going back to userland */
+	bool p_killed;
 #endif // OPT_SYSCALLS
 
 #ifdef OPT_SYSFS
@@ -132,9 +158,27 @@ extern void proc_make_zombie(int exit_code, struct proc *proc);
 
 extern pid_t proc_check_zombie(struct proc *child, int *wstatus, int options, struct proc *proc);
 
-extern struct proc *proc_get_child(pid_t pid, struct proc *proc);
+extern int proc_get_child(pid_t pid, struct proc *proc, struct proc **child);
 
 extern struct proc *proc_copy(void);
+
+extern void proc_for_each_process(void (*f)(struct proc *proc, void *private), void *private);
+
+extern int proc_kill(pid_t pid);
+
+extern int proc_uthread_create(struct proc *proc, struct uthread **ret);
+
+extern void proc_uthread_destroy(struct proc *proc, struct uthread *ut);
+
+extern bool proc_uthread_exit(struct proc *proc, int status);
+
+extern int proc_uthread_join(struct proc *proc, int tid, int *status);
+
+extern bool proc_stop_threads(struct proc *proc, bool exiting);
+
+extern int proc_set_rss_limit(pid_t pid, size_t pages);
+
+extern void proc_print_mem_info(void);
 #endif
 
 /* Call once during system startup to allocate data structures. */
@@ -154,6 +198,20 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/* More than one thread can have the address space loaded in a TLB. */
+static inline bool proc_multithreaded(struct proc *proc)
+{
+	return READ_ONCE(proc->p_numthreads) > 1;
+}
+
+#if OPT_SYSCALLS
+/* The process is being torn down, its threads have to leave the kernel. */
+static inline bool proc_stopping(struct proc *proc)
+{
+	return READ_ONCE(proc->p_exiting) || READ_ONCE(proc->p_killed);
+}
+#endif // OPT_SYSCALLS
+
 /* Fetch the address space of the current process. */
 struct addrspace *proc_getas(void);
 
@@ -161,7 +219,9 @@ struct addrspace *proc_getas(void);
 struct addrspace *proc_setas(struct addrspace *);
 
 #ifdef OPT_SYSFS
-extern int proc_add_new_file(struct proc *proc, struct file *file);
+extern int proc_add_new_file(struct proc *proc, struct file *file, int *fd);
+
+extern int proc_dup2_file(struct proc *proc, int oldfd, int newfd);
 
 extern int proc_removed_file(struct proc *proc, int fd);
 
@@ -3,13 +3,33 @@
 
 #include <machine/pt.h>
 #include <types.h>
+#include <list.h>
+#include "opt-hashpt.h"
 
 typedef struct pmd_t pmd_t;
 
+#if OPT_HASHPT
+/*
+ * With the hashed page table the entries of every address
+ * space live in one global hash table keyed by (page table,
+ * virtual page), see vm/hpt.c. Only the entries in use are
+ * allocated.
+ */
+struct page_table {
+    struct list_head entries;   /* entries of this page table */
+    size_t nr_entries;     /* number of entries in `entries` */
+    size_t total_pages;    /* number of allocated pages */
+    size_t swap_pages;     /* number of pages in the swap memory */
+    size_t table_pages;    /* number of pages used by the entries */
+};
+#else
 struct page_table {
     pmd_t *pmd;     /* pointer to the PageMiddleDirectory */
     size_t total_pages;    /* number of allocated pages */
+    size_t swap_pages;     /* number of pages in the swap memory */
+    size_t table_pages;    /* number of pages used by the tables */
 };
+#endif // OPT_HASHPT
 
 struct pt_page_flags {
     bool page_rw;       /* page is writable */
@@ -22,7 +42,7 @@ typedef enum walk_action_t {
     WALK_REPEAT,
 } walk_action_t;
 
-typedef walk_action_t (*walk_ops_t)(struct page_table *pt, pte_t *pte, vaddr_t page_addr);
+typedef walk_action_t (*walk_ops_t)(struct page_table *pt, pte_t *pte, vaddr_t page_addr, void *private);
 
 
 #define pt_for_each_pte_entry(pte, pte_entry, start, end, pmd_curr_index)   \
@@ -38,20 +58,37 @@ static inline void pt_inc_page_count(struct page_table *pt, int count)
     pt->total_pages += count;
 }
 
+static inline void pt_inc_swap_count(struct page_table *pt, int count)
+{
+    pt->swap_pages += count;
+}
+
 extern int pt_init(struct page_table *pt);
 
 extern void pt_destroy(struct page_table *pt);
 
 extern pte_t *pt_get_or_alloc_pte(struct page_table *pt, vaddr_t addr);
 
+extern void pt_pte_populated(pte_t *pte_entry);
+
+extern bool pt_free_empty_pte(struct page_table *pt, vaddr_t addr);
+
+extern void pt_clear_pte(struct page_table *pt, vaddr_t addr);
+
+extern void pt_unmap_range(struct page_table *pt, vaddr_t start, vaddr_t end);
+
 extern int pt_alloc_page(struct page_table *pt, vaddr_t addr, struct pt_page_flags page_flags, paddr_t *paddr);
 
 extern int pt_alloc_page_range(struct page_table *pt, vaddr_t start, vaddr_t end, struct pt_page_flags flags);
 
-extern int pt_walk_page_table(struct page_table *pt, vaddr_t start, vaddr_t end, walk_ops_t f);
+extern int pt_walk_page_table(struct page_table *pt, vaddr_t start, vaddr_t end, walk_ops_t f, void *private);
 
 extern paddr_t pt_get_paddr(struct page_table *pt, vaddr_t addr);
 
 extern int pt_copy(struct page_table *new, struct page_table *old);
 
+#if OPT_HASHPT
+extern void hpt_print_info(void);
+#endif // OPT_HASHPT
+
 #endif // _PT_H_
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <types.h>
+#include <lib.h>
+#include <list.h>
+#include <spinlock.h>
+
+/*
+ * Every slot of a cache holds an object followed by the
+ * pointer to the next free slot, this way the content of
+ * a free object is never touched and what the constructor
+ * initialized is preserved across free/alloc.
+ */
+#define KMEM_CACHE_ALIGN    (8)
+
+/*
+ * Number of empty slabs a cache keeps, the others are
+ * given back to the page allocator.
+ */
+#define KMEM_CACHE_FREE_SLABS   (1)
+
+/**
+ * @brief Cache of objects of the same type. The objects are
+ * allocated from slabs, each slab is one page split in
+ * slots of `size` bytes.
+ *
+ */
+struct kmem_cache {
+    const char *name;               /* name of the cache */
+    size_t object_size;             /* size of the object */
+    size_t free_offset;             /* offset of the free pointer inside a slot */
+    size_t size;                    /* size of a slot */
+    void (*ctor)(void *);           /* called once on each object of a new slab */
+
+    struct spinlock cache_lock;     /* lock for the slab lists and counters */
+    struct list_head slabs_partial; /* slabs with some free object */
+    struct list_head slabs_full;    /* slabs without free objects */
+    struct list_head slabs_free;    /* slabs without used objects */
+
+    unsigned nr_slabs;              /* number of slabs in the cache */
+    unsigned nr_free_slabs;         /* number of slabs in slabs_free */
+    unsigned nr_active;             /* number of allocated objects */
+
+    struct list_head cache_list;    /* entry in the list of all the caches */
+};
+
+#define KMEM_CACHE_INIT(cache, cache_name, obj_size, obj_ctor) {                     \
+    .name = cache_name,                                                             \
+    .object_size = obj_size,                                                        \
+    .free_offset = ROUNDUP(obj_size, sizeof(void *)),                               \
+    .size = ROUNDUP(ROUNDUP(obj_size, sizeof(void *)) + sizeof(void *), KMEM_CACHE_ALIGN), \
+    .ctor = obj_ctor,                                                               \
+    .cache_lock = SPINLOCK_INITIALIZER,                                             \
+    .slabs_partial = LIST_HEAD_INIT((cache).slabs_partial),                         \
+    .slabs_full = LIST_HEAD_INIT((cache).slabs_full),                               \
+    .slabs_free = LIST_HEAD_INIT((cache).slabs_free),                               \
+    .nr_slabs = 0,                                                                  \
+    .nr_free_slabs = 0,                                                             \
+    .nr_active = 0,                                                                 \
+    .cache_list = LIST_HEAD_INIT((cache).cache_list),                               \
+}
+
+/**
+ * @brief Define a cache of objects of `type`, the cache is
+ * statically initialized so it can be used before the
+ * VM bootstrap.
+ *
+ */
+#define DEFINE_KMEM_CACHE(cache, type, ctor) \
+    struct kmem_cache cache = KMEM_CACHE_INIT(cache, #type, sizeof(type), ctor)
+
+extern void *kmem_cache_alloc(struct kmem_cache *cache);
+
+extern void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+extern unsigned kmem_cache_shrink(struct kmem_cache *cache);
+
+extern unsigned kmem_cache_shrink_all(void);
+
+extern void kmem_cache_print_info(void);
+
+#endif // _SLAB_H_
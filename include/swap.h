@@ -39,6 +39,8 @@ extern int swap_inc_page(swap_entry_t entry);
 
 extern int swap_dec_page(swap_entry_t entry);
 
+extern int swap_dec_pages(const swap_entry_t *entries, size_t nentries);
+
 extern void swap_print_info(void);
 
 extern void swap_print_all(void);
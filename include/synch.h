@@ -65,6 +65,15 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_interruptible: like P, but fails with EINTR instead of
+ *                  sleeping once `interrupted` returns true.
+ * sem_wakeall:     wakes every sleeper without changing the count,
+ *                  the interruptible ones check `interrupted` again.
+ */
+int P_interruptible(struct semaphore *, bool (*interrupted)(void));
+void sem_wakeall(struct semaphore *);
+
 /*
  * Simple lock for mutual exclusion.
  *
@@ -93,6 +102,8 @@ void lock_destroy(struct lock *);
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock only if it is free, never sleeps.
+ *                   Returns true if the lock was acquired.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -101,6 +112,7 @@ void lock_destroy(struct lock *);
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
+bool lock_tryacquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
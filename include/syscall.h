@@ -36,6 +36,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
+struct kmem_cache; /* from <slab.h> */
 
 /*
  * The system call dispatcher.
@@ -50,6 +51,12 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+/* Helper for thread_create(), enters user mode at the trapframe epc. */
+__DEAD void enter_new_thread(struct trapframe *tf);
+
+/* Cache of the trapframes handed to the forked process and threads. */
+extern struct kmem_cache trapframe_cache;
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
@@ -82,6 +89,12 @@ extern int sys_fork(pid_t *pid, struct trapframe *tf);
 extern int sys_execv(const_userptr_t pathname, userptr_t argv);
 
 extern int sys_fstat(int fd, userptr_t statbuf);
+
+extern int sys_thread_create(userptr_t entry, userptr_t arg, struct trapframe *tf, int *tid);
+
+extern void sys_thread_exit(int status);
+
+extern int sys_thread_join(int tid, userptr_t status);
 #endif // OPT_SYSCALLS
 
 #if OPT_SYSFS
@@ -90,6 +103,14 @@ extern int sys_open(const_userptr_t pathname, int flags, mode_t mode, int *fd);
 extern int sys_close(int fd);
 
 extern int sys_remove(const_userptr_t path);
+
+extern int sys_readv(int fd, const_userptr_t iov, int iovcnt, size_t *size_read);
+
+extern int sys_writev(int fd, const_userptr_t iov, int iovcnt, size_t *size_wrote);
+
+extern int sys_pread(int fd, userptr_t buf, size_t nbyte, off_t offset, size_t *size_read);
+
+extern int sys_pwrite(int fd, const_userptr_t buf, size_t nbyte, off_t offset, size_t *size_wrote);
 #endif // OPT_SYSFS
 
 #endif /* _SYSCALL_H_ */
@@ -37,6 +37,8 @@
 
 #include "opt-args.h"
 #include "opt-atomic.h"
+#include "opt-paging.h"
+#include "opt-sysfs.h"
 
 /*
  * Test code.
@@ -102,6 +104,15 @@ int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
 
+#if OPT_PAGING
+int pagebench(int, char **);
+int ptbench(int, char **);
+#endif
+
+#if OPT_SYSFS
+int iobench(int, char **);
+#endif
+
 /* Routine for running a user-level program. */
 #if OPT_ARGS
 int runprogram(int argc, char **args);
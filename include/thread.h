@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct uthread;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -106,6 +107,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	struct uthread *t_uthread;	/* User thread record, NULL for the main thread */
+
 	/* add more here as needed */
 };
 
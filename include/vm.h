@@ -53,14 +53,13 @@ typedef enum fault_value_t {
 #define SWAP_PAGE_THRESHOLD(max, curr) (curr > ((80 * (max)) / 100))
 
 /*
- * In OS161 the RAM size is very limited, so we keep the size
- * of the buddy allocator order low to not loose many pages
- * in the process, this is due to the fact that is more complicated
- * to manage the last pages, that will not be aligned with the
- * last order, and further cheks are required to to not place
- * pages out of memory.
+ * Max order (power of 2) of the buddy allocator, included.
+ * The start and the end of the RAM do not need to be aligned
+ * to a max order block, the memory around them is seeded with
+ * lower order blocks, so a high order costs no memory. It
+ * bounds the largest kmalloc(), 4 MB with 4 KB pages.
  */
-#define MAX_ORDER       (6)    /* Max order (power of 2) of the buddy allocator, included */
+#define MAX_ORDER       (10)
 
 
 /**
@@ -89,6 +88,12 @@ struct free_area {
 struct zone {
     vaddr_t             first_valid_addr;
     vaddr_t             last_valid_addr;
+    /*
+     * First address whose pages are not initialized yet,
+     * the memory from here to `last_valid_addr` is handed
+     * to the buddy allocator by the deferred init.
+     */
+    vaddr_t             deferred_addr;
     size_t              alloc_pages;
     size_t              total_pages;
     struct free_area    free_area[MAX_ORDER + 1];
@@ -101,6 +106,8 @@ struct zone {
 
 
 extern struct page *page_table;
+extern size_t total_pages;
+extern size_t initialized_pages;
 
 
 static inline struct page *
@@ -133,12 +140,25 @@ page_to_pfn(struct page *page)
 	return kvaddr_to_pfn(page_to_kvaddr(page));
 }
 
+/* Page granular copy and zero, in vm/pagecopy.c */
+void kpage_copy(void *dst, const void *src);
+void kpage_zero(void *dst);
+
 static inline void
 clear_page(struct page *page)
 {
 	KASSERT(page != NULL);
 
-	memset((void *)page_to_kvaddr(page), 0, PAGE_SIZE);
+	kpage_zero((void *)page_to_kvaddr(page));
+}
+
+static inline void
+copy_page(struct page *dst, struct page *src)
+{
+	KASSERT(dst != NULL);
+	KASSERT(src != NULL);
+
+	kpage_copy((void *)page_to_kvaddr(dst), (const void *)page_to_kvaddr(src));
 }
 
 static inline void
@@ -206,6 +226,14 @@ extern struct page *alloc_pages(size_t npages);
 
 extern void free_pages(struct page *page);
 
+extern void free_pages_list(struct list_head *page_list);
+
+extern void vm_deferred_init_bootstrap(void);
+
+extern void vm_compact_bootstrap(void);
+
+extern void user_pages_shared(size_t *shared, size_t *sharing);
+
 extern struct page *alloc_user_page(void);
 
 extern struct page *alloc_user_zeroed_page(void);
@@ -3,6 +3,31 @@
 
 #include <types.h>
 
+/*
+ * Addresses a batch invalidates one by one, a batch
+ * collecting more than this flushes the whole TLB.
+ */
+#define TLB_BATCH_MAX (16)
+
+/**
+ * @brief Set of TLB entries to invalidate, the scans of the
+ * page tables collect the entries and invalidate them with
+ * one TLB access per batch instead of one per page.
+ * 
+ */
+struct tlb_batch {
+    vaddr_t addrs[TLB_BATCH_MAX];   /* pages to invalidate */
+    unsigned nr;                    /* number of entries in `addrs` */
+    bool full;                      /* too many pages, flush everything */
+    bool remote;                    /* the pages could be cached by other cpus */
+};
+
+#define TLB_BATCH_INIT ((struct tlb_batch) {   \
+    .nr = 0,                                    \
+    .full = false,                              \
+    .remote = false,                            \
+})
+
 typedef enum tlb_state_t {
     TLB_ENTRY_PRESENT,
     TLB_ENTRY_NOT_PRESENT,
@@ -16,4 +41,12 @@ extern void vm_tlb_flush(void);
 
 extern void vm_tlb_flush_one(vaddr_t addr);
 
+extern void vm_tlb_shootdown(vaddr_t addr);
+
+extern void vm_tlb_invalidate(vaddr_t addr);
+
+extern void vm_tlb_batch_add(struct tlb_batch *batch, vaddr_t addr, bool remote);
+
+extern void vm_tlb_batch_flush(struct tlb_batch *batch);
+
 #endif // _VM_TLB_H_
\ No newline at end of file
@@ -34,9 +34,19 @@
  * Wait channel.
  */
 
+#include <threadlist.h>
 
 struct spinlock; /* in spinlock.h */
-struct wchan; /* Opaque */
+
+/*
+ * A wchan is protected by an associated, passed-in spinlock.
+ * The structure is visible so that it can be embedded in
+ * other objects, don't touch the fields outside thread.c.
+ */
+struct wchan {
+	const char *wc_name;		/* name for this channel */
+	struct threadlist wc_threads;	/* list of waiting threads */
+};
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -50,6 +60,13 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Initialize and clean up a wait channel embedded in
+ * another structure. Must be empty and unlocked at cleanup.
+ */
+void wchan_init(struct wchan *wc, const char *name);
+void wchan_cleanup(struct wchan *wc);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
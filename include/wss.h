@@ -0,0 +1,12 @@
+#ifndef _WSS_H_
+#define _WSS_H_
+
+#include <types.h>
+
+extern void wss_bootstrap(void);
+
+extern void wss_hardclock(void);
+
+extern void wss_print_info(void);
+
+#endif // _WSS_H_
@@ -49,6 +49,10 @@
 #include <syscall.h>
 #include <test.h>
 #include <swap.h>
+#include <ksm.h>
+#include <wss.h>
+#include <oom.h>
+#include <file.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
 
@@ -132,9 +136,18 @@ boot(void)
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+#if OPT_SYSFS
+	file_console_bootstrap();
+#endif // OPT_SYSFS
+
 #if OPT_PAGING
+	vm_deferred_init_bootstrap();
+	vm_compact_bootstrap();
 	swap_bootsrap();
 	kproc_bootstrap();
+	ksm_bootstrap();
+	wss_bootstrap();
+	oom_bootstrap();
 #endif // OPT_PAGING
 
 	kheap_nextgeneration();
@@ -45,12 +45,18 @@
 #include <syscall.h>
 #include <vm.h>
 #include <swap.h>
+#include <slab.h>
+#include <ksm.h>
+#include <wss.h>
 #include <test.h>
 #include <current.h>
 #include <fault_stat.h>
+#include <file.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-syscalls.h"
+#include "opt-hashpt.h"
+#include "opt-sysfs.h"
 #include "opt-args.h"
 #include "opt-atomic.h"
 
@@ -370,6 +376,37 @@ cmd_deadlock(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_SYSFS
+/*
+ * Command for showing or setting the max number of
+ * fds of a process.
+ */
+static
+int
+cmd_fdlimit(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("fd limit: %u\n", file_fd_limit);
+		return 0;
+	}
+
+	if (nargs != 2) {
+		kprintf("Usage: fdlimit [limit]\n");
+		return EINVAL;
+	}
+
+	result = file_set_fd_limit(atoi(args[1]));
+	if (result) {
+		kprintf("fdlimit: the limit must be between 1 and %d\n",
+			FD_LIMIT_MAX);
+	}
+
+	return result;
+}
+#endif // OPT_SYSFS
+
 /*
  * Command for shutting down.
  */
@@ -398,6 +435,14 @@ cmd_memstat(int nargs, char **args)
 	kprintf("OS161 Memory usage statistics:\n");
 	vm_kpages_stats();
     kprintf("\n");
+#if OPT_PAGING
+	ksm_print_info();
+	kprintf("\n");
+#endif // OPT_PAGING
+#if OPT_HASHPT
+	hpt_print_info();
+	kprintf("\n");
+#endif // OPT_HASHPT
 
 	return 0;
 }
@@ -441,6 +486,59 @@ cmd_swapstats(int nargs, char **args)
 	return 0;
 }
 
+/**
+ * @brief Memory used by each process.
+ * 
+ * @param nargs 
+ * @param args 
+ * @return int 
+ */
+static int
+cmd_procmemstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_print_mem_info();
+	kprintf("\n");
+	wss_print_info();
+	kprintf("\n");
+
+	return 0;
+}
+
+/**
+ * @brief Sets the resident pages limit of a process, once
+ * over it reclaim takes its pages first.
+ * 
+ * @param nargs 
+ * @param args 
+ * @return int 
+ */
+static int
+cmd_rsslimit(int nargs, char **args)
+{
+	int result, pages;
+
+	if (nargs != 3) {
+		kprintf("Usage: rsslimit pid pages (0 for a fair share)\n");
+		return EINVAL;
+	}
+
+	pages = atoi(args[2]);
+	if (pages < 0) {
+		kprintf("rsslimit: the limit must not be negative\n");
+		return EINVAL;
+	}
+
+	result = proc_set_rss_limit(atoi(args[1]), pages);
+	if (result) {
+		kprintf("rsslimit: no process with pid %s\n", args[1]);
+	}
+
+	return result;
+}
+
 /**
  * @brief Dumps the whole swap memory.
  * 
@@ -577,6 +675,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_slabstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_print_info();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -648,6 +758,9 @@ static const char *opsmenu[] = {
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
+#if OPT_SYSFS
+	"[fdlimit] Set the process fd limit  ",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -672,6 +785,13 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+#if OPT_PAGING
+	"[pb]  Page copy/zero benchmark      ",
+	"[ptb] Page table benchmark          ",
+#endif
+#if OPT_SYSFS
+	"[iob] Read/write path benchmark     ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -716,10 +836,13 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[slab] Slab caches stats            ",
 	"[mem] Check memory usage            ",
 	"[fault] Fault stats                 ",
 	"[swap] Swap memory stats            ",
 	"[swapdump] Dump swap memory         ",
+	"[procmem] Process memory stats      ",
+	"[rsslimit] Set a process rss limit  ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -763,6 +886,9 @@ static struct {
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
+#if OPT_SYSFS
+	{ "fdlimit",	cmd_fdlimit },
+#endif
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -771,10 +897,13 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "slab",       cmd_slabstats },
 	{ "mem",        cmd_memstat },
 #if OPT_PAGING
 	{ "fault",      cmd_faultstat },
 	{ "swap",       cmd_swapstats },
+	{ "procmem",    cmd_procmemstats },
+	{ "rsslimit",   cmd_rsslimit },
 	{ "swapdump",   cmd_swapdump },
 #endif // OPT_PAGING
 
@@ -787,6 +916,13 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+#if OPT_PAGING
+	{ "pb",		pagebench },
+	{ "ptb",	ptbench },
+#endif
+#if OPT_SYSFS
+	{ "iob",	iobench },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
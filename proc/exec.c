@@ -1,4 +1,5 @@
 #include <proc.h>
+#include <current.h>
 #include <exec.h>
 #include <addrspace.h>
 #include <copyinout.h>
@@ -8,7 +9,11 @@
 #include <kern/fcntl.h>
 #include <kern/limits.h>
 
-static int exec_new_as(char *pathname, int argc, char **argv, struct exec_params *params) {
+/*
+ * Builds the address space of the new program in `*ret`,
+ * the caller switches to it.
+ */
+static int exec_new_as(char *pathname, int argc, char **argv, struct exec_params *params, struct addrspace **ret) {
 	struct addrspace *as;
 	struct vnode *vnode;
 	int retval;
@@ -52,17 +57,16 @@ static int exec_new_as(char *pathname, int argc, char **argv, struct exec_params
 	if (retval)
         goto as_cleanup;
 
-	/* Switch to it and activate it. */
-	proc_setas(as);
-	as_activate();
+    *ret = as;
 
     return 0;
 
 as_cleanup:
+    /* also closes the file */
     as_destroy(as);
+    return retval;
 
 vnode_cleanup:
-	/* p_addrspace will go away when curproc is destroyed */
     vfs_close(vnode);
 
     return retval;
@@ -138,8 +142,27 @@ int sys_execv(const_userptr_t pathname, userptr_t argv) {
 	KASSERT(proc_getas() != NULL);
 
     struct exec_params params;
-    retval = exec_new_as(kern_pahtname, argc, kern_argv, &params);
+    struct addrspace *as;
+    retval = exec_new_as(kern_pahtname, argc, kern_argv, &params, &as);
+    if (retval)
+        goto argv_space_cleanup;
 
+    /*
+     * The other threads run in the address space being replaced,
+     * they are stopped only once exec can't fail anymore. Losing
+     * the race against another thread tearing down the process,
+     * the caller leaves on its way back to userland.
+     */
+    if (!proc_stop_threads(curproc, false)) {
+        as_destroy(as);
+        retval = EINTR;
+        goto argv_space_cleanup;
+    }
+
+    /* Switch to it and activate it. */
+    as = proc_setas(as);
+    as_activate();
+    as_destroy(as);
 
 argv_space_cleanup:
     kfree(argv_space);
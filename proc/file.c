@@ -9,13 +9,44 @@
 #include <kern/seek.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
+#include <kern/iovec.h>
+#include <proc.h>
+#include <slab.h>
+#include <membar.h>
+#include <rwonce.h>
 
+static DEFINE_KMEM_CACHE(file_cache, struct file, NULL);
+
+/*
+ * Max bytes moved by a single I/O, the count is
+ * returned to userspace as a signed 32 bit value.
+ */
+#define FILE_IO_MAX     ((size_t)0x7fffffff)
+
+/*
+ * Max number of fds of a process, it can be
+ * changed at runtime with `file_set_fd_limit`.
+ */
+unsigned file_fd_limit = OPEN_MAX;
+
+/*
+ * stdin, stdout and stderr of the new processes,
+ * they hold a reference so they are never closed.
+ */
+static struct file *console_files[3];
+
+/*
+ * Only rejects the fds no table can hold: the ones of an
+ * open file are checked against the size of the table, a
+ * lower limit set later must not hide them. The limit is
+ * applied when a new fd is taken.
+ */
 static bool check_fd(int fd)
 {
     if (fd < 0)
         return false;
 
-    if (fd >= OPEN_MAX)
+    if ((unsigned)fd >= FD_LIMIT_MAX)
         return false;
 
     return true;
@@ -32,13 +63,13 @@ struct file *file_create(void)
 {
     struct file *file;
 
-    file = kmalloc(sizeof(struct file));
+    file = kmem_cache_alloc(&file_cache);
     if (!file)
         return NULL;
 
     file->file_lock = lock_create("file_lock");
     if (!file->file_lock) {
-        kfree(file);
+        kmem_cache_free(&file_cache, file);
         return NULL;
     }
 
@@ -53,6 +84,23 @@ struct file *file_create(void)
     return file;
 }
 
+/**
+ * @brief frees a file returned by file_create() that
+ * never got a vnode, nor was added to a table.
+ * 
+ * @param file 
+ */
+void file_free(struct file *file)
+{
+    KASSERT(file != NULL);
+    KASSERT(file->vnode == NULL);
+    KASSERT(refcount_read(&file->refcount) == 1);
+
+    lock_destroy(file->file_lock);
+
+    kmem_cache_free(&file_cache, file);
+}
+
 void file_destroy(struct file *file)
 {
     bool destroy;
@@ -69,55 +117,199 @@ void file_destroy(struct file *file)
 
     vfs_close(file->vnode);
 
-    kfree(file);
+    kmem_cache_free(&file_cache, file);
 }
 
-int file_read(struct file *file, void *kbuf, size_t nbyte, size_t *byte_read)
+/**
+ * @brief performs the I/O described by `uio` on the file.
+ * A positional uio carries its own offset and runs without
+ * the file lock, otherwise the shared offset is used and
+ * advanced by the bytes moved.
+ * 
+ * @param file file of the I/O
+ * @param uio initialized uio, its offset is ignored if not positional
+ * @param positional do not use the file offset
+ * @param nbyte returns the number of bytes moved
+ * @return int error if any
+ */
+static int file_io(struct file *file, struct uio *uio, bool positional, size_t *nbyte)
 {
-    struct iovec iovec;
-    struct uio uio;
+    size_t resid = uio->uio_resid;
     int retval;
 
     KASSERT(file != NULL);
 
-    lock_acquire(file->file_lock);
-    uio_kinit(&iovec, &uio, kbuf, nbyte, file->offset, UIO_READ);
+    if (positional) {
+        if (!VOP_ISSEEKABLE(file->vnode))
+            return ESPIPE;
+        if (uio->uio_offset < 0)
+            return EINVAL;
+    } else {
+        lock_acquire(file->file_lock);
+        uio->uio_offset = file->offset;
+    }
 
-    retval = VOP_READ(file->vnode, &uio);
-    if (retval) {
+    if (uio->uio_rw == UIO_READ)
+        retval = VOP_READ(file->vnode, uio);
+    else
+        retval = VOP_WRITE(file->vnode, uio);
+
+    if (!retval) {
+        /* check how many bytes were moved */
+        *nbyte = resid - uio->uio_resid;
+        if (!positional)
+            file->offset += (off_t)*nbyte;
+    }
+
+    if (!positional)
         lock_release(file->file_lock);
-        return retval;
+
+    return retval;
+}
+
+/**
+ * @brief builds a uio on the user buffers of the
+ * current process described by `iov`.
+ * 
+ * @return int EINVAL if the total size overflows
+ */
+static int file_uio_init(struct uio *uio, struct iovec *iov, int iovcnt,
+                         off_t offset, enum uio_rw rw)
+{
+    size_t resid = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > FILE_IO_MAX - resid)
+            return EINVAL;
+        resid += iov[i].iov_len;
     }
 
-    /* check if all the bytes were read */
-    *byte_read = nbyte - uio.uio_resid;
-    file->offset += (off_t)*byte_read;
-    lock_release(file->file_lock);
+    uio->uio_iov = iov;
+    uio->uio_iovcnt = iovcnt;
+    uio->uio_offset = offset;
+    uio->uio_resid = resid;
+    uio->uio_segflg = UIO_USERSPACE;
+    uio->uio_rw = rw;
+    uio->uio_space = proc_getas();
 
     return 0;
 }
 
-int file_write(struct file *file, void *kbuf, size_t nbyte, size_t *byte_wrote)
+/**
+ * @brief reads from the file into a user buffer of the
+ * current process, the data goes straight from the vnode
+ * to the user pages.
+ * 
+ * @param file file to read
+ * @param buf user buffer
+ * @param nbyte size of the buffer
+ * @param byte_read returns the number of bytes read
+ * @return int error if any
+ */
+int file_read(struct file *file, userptr_t buf, size_t nbyte, size_t *byte_read)
 {
     struct iovec iovec;
     struct uio uio;
-    int retval;
 
-    lock_acquire(file->file_lock);
-    uio_kinit(&iovec, &uio, kbuf, nbyte, file->offset, UIO_WRITE);
+    uio_uinit(&iovec, &uio, buf, nbyte, 0, UIO_READ);
 
-    retval = VOP_WRITE(file->vnode, &uio);
-    if (retval) {
-        lock_release(file->file_lock);
+    return file_io(file, &uio, false, byte_read);
+}
+
+/**
+ * @brief writes a user buffer of the current process
+ * to the file, the data goes straight from the user
+ * pages to the vnode.
+ * 
+ * @param file file to write
+ * @param buf user buffer
+ * @param nbyte size of the buffer
+ * @param byte_wrote returns the number of bytes written
+ * @return int error if any
+ */
+int file_write(struct file *file, const_userptr_t buf, size_t nbyte, size_t *byte_wrote)
+{
+    struct iovec iovec;
+    struct uio uio;
+
+    /* the uio is only read from on a write */
+    uio_uinit(&iovec, &uio, (userptr_t)buf, nbyte, 0, UIO_WRITE);
+
+    return file_io(file, &uio, false, byte_wrote);
+}
+
+/**
+ * @brief like `file_read` but at `offset`, the file
+ * offset is neither used nor locked.
+ */
+int file_pread(struct file *file, userptr_t buf, size_t nbyte, off_t offset, size_t *byte_read)
+{
+    struct iovec iovec;
+    struct uio uio;
+
+    uio_uinit(&iovec, &uio, buf, nbyte, offset, UIO_READ);
+
+    return file_io(file, &uio, true, byte_read);
+}
+
+/**
+ * @brief like `file_write` but at `offset`, the file
+ * offset is neither used nor locked.
+ */
+int file_pwrite(struct file *file, const_userptr_t buf, size_t nbyte, off_t offset, size_t *byte_wrote)
+{
+    struct iovec iovec;
+    struct uio uio;
+
+    uio_uinit(&iovec, &uio, (userptr_t)buf, nbyte, offset, UIO_WRITE);
+
+    return file_io(file, &uio, true, byte_wrote);
+}
+
+/**
+ * @brief reads from the file into the user buffers
+ * described by `iov`, filled in order with a single
+ * VOP_READ.
+ * 
+ * @param file file to read
+ * @param iov array of user buffers, in kernel memory
+ * @param iovcnt number of buffers
+ * @param byte_read returns the number of bytes read
+ * @return int error if any
+ */
+int file_readv(struct file *file, struct iovec *iov, int iovcnt, size_t *byte_read)
+{
+    struct uio uio;
+    int retval;
+
+    retval = file_uio_init(&uio, iov, iovcnt, 0, UIO_READ);
+    if (retval)
         return retval;
-    }
 
-    /* check if all the bytes were written */
-    *byte_wrote = nbyte - uio.uio_resid;
-    file->offset += (off_t)*byte_wrote;
-    lock_release(file->file_lock);
+    return file_io(file, &uio, false, byte_read);
+}
 
-    return 0;
+/**
+ * @brief writes the user buffers described by `iov`
+ * to the file, in order with a single VOP_WRITE.
+ * 
+ * @param file file to write
+ * @param iov array of user buffers, in kernel memory
+ * @param iovcnt number of buffers
+ * @param byte_wrote returns the number of bytes written
+ * @return int error if any
+ */
+int file_writev(struct file *file, struct iovec *iov, int iovcnt, size_t *byte_wrote)
+{
+    struct uio uio;
+    int retval;
+
+    retval = file_uio_init(&uio, iov, iovcnt, 0, UIO_WRITE);
+    if (retval)
+        return retval;
+
+    return file_io(file, &uio, false, byte_wrote);
 }
 
 int file_lseek(struct file *file, off_t offset, int whence, off_t *offset_location)
@@ -193,45 +385,216 @@ off_t file_read_offset(struct file *file)
     return offset;
 }
 
-// static int __file_next_fd(struct file *head) 
-// {
-//     KASSERT(head != NULL);
-//     KASSERT(!list_empty(&head->file_head));
+/*
+ * Helpers for the bitmap of the used fds, a set bit
+ * means that the slot of fd_array is taken. The bitmap
+ * is only accessed holding the table_lock.
+ */
+static inline void fd_mark(struct fd_table *fdt, int fd)
+{
+    fdt->open_fds[fd / FD_MAP_BITS] |= 1U << (fd % FD_MAP_BITS);
+}
 
-//     struct file *last = list_last_entry(&head->file_head, struct file, file_head);
+static inline void fd_unmark(struct fd_table *fdt, int fd)
+{
+    fdt->open_fds[fd / FD_MAP_BITS] &= ~(1U << (fd % FD_MAP_BITS));
+}
 
-//     return last->fd;
-// }
+static inline bool fd_isset(struct fd_table *fdt, int fd)
+{
+    return (fdt->open_fds[fd / FD_MAP_BITS] & (1U << (fd % FD_MAP_BITS))) != 0;
+}
 
-int file_next_fd(struct file_table *head)
+/**
+ * @brief finds the lowest unused fd below `limit`,
+ * skipping a whole word of the bitmap when it is full.
+ * 
+ * @param fdt fd table
+ * @param limit fd limit
+ * @return int the fd or -1 if the table is full
+ */
+static int fd_find_first_zero(struct fd_table *fdt, unsigned limit)
 {
-    struct file *file;
-    int fd = 0, i;
+    uint32_t free_bits;
+    unsigned i;
+    unsigned fd;
 
-    KASSERT(head != NULL);
-    KASSERT(head->fd_array != NULL);
-    KASSERT(head->open_files > 0);
+    for (i = 0; i < fdt->max_fds / FD_MAP_BITS; i++) {
+        free_bits = ~fdt->open_fds[i];
+        if (free_bits == 0)
+            continue;
 
-    lock_acquire(head->table_lock);
+        fd = i * FD_MAP_BITS + __builtin_ctz(free_bits);
+        return fd < limit ? (int)fd : -1;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief finds the highest used fd.
+ * 
+ * @param fdt fd table
+ * @return int the fd or -1 if the table is empty
+ */
+static int fd_find_last(struct fd_table *fdt)
+{
+    unsigned i;
 
-    for (i = 0; i < OPEN_MAX; i++) {
-        file = head->fd_array[i];
-        if (!file)
+    for (i = fdt->max_fds / FD_MAP_BITS; i > 0; i--) {
+        if (fdt->open_fds[i - 1] == 0)
             continue;
 
-        if (file->fd > fd)
-            fd = file->fd;
+        return (i - 1) * FD_MAP_BITS + (FD_MAP_BITS - 1) - __builtin_clz(fdt->open_fds[i - 1]);
     }
 
-    lock_release(head->table_lock);
+    return -1;
+}
+
+/**
+ * @brief publishes the file in the slot, the file
+ * must be visible before it since `file_table_get`
+ * reads the slots without locking.
+ */
+static inline void fd_install(struct fd_table *fdt, int fd, struct file *file)
+{
+    membar_store_store();
+    WRITE_ONCE(fdt->fd_array[fd], file);
+}
+
+/**
+ * @brief sets the fd limit of the processes, the tables
+ * already larger than the limit keep their files.
+ * 
+ * @param limit new limit, at most FD_LIMIT_MAX
+ * @return int EINVAL if the limit is not valid
+ */
+int file_set_fd_limit(unsigned limit)
+{
+    if (limit == 0 || limit > FD_LIMIT_MAX)
+        return EINVAL;
+
+    WRITE_ONCE(file_fd_limit, limit);
 
-    return fd + 1;
+    return 0;
+}
+
+/**
+ * @brief grows the table so that it can hold `fd`,
+ * doubling the size until it fits, but not over `limit`.
+ * The replaced table is kept until the file table is
+ * destroyed, as a lockless reader could still be using it.
+ * 
+ * @param ftable file table
+ * @param fd fd to make room for
+ * @param limit number of fds the table can hold at most
+ * @return int EMFILE if over the limit, ENOMEM
+ */
+static int fd_table_grow(struct file_table *ftable, int fd, unsigned limit)
+{
+    struct fd_table *old = ftable->fdt, *new;
+    unsigned max_fds;
+    size_t old_map, new_map;
+
+    KASSERT(lock_do_i_hold(ftable->table_lock));
+    KASSERT(fd >= 0);
+
+    if ((unsigned)fd < old->max_fds)
+        return 0;
+
+    if ((unsigned)fd >= limit)
+        return EMFILE;
+
+    for (max_fds = old->max_fds; max_fds <= (unsigned)fd; max_fds *= 2)
+        ;
+    if (max_fds > ROUNDUP(limit, FD_MAP_BITS))
+        max_fds = ROUNDUP(limit, FD_MAP_BITS);
+
+    old_map = old->max_fds / FD_MAP_BITS * sizeof(uint32_t);
+    new_map = max_fds / FD_MAP_BITS * sizeof(uint32_t);
+
+    /* the bitmap and the slots follow the struct */
+    new = kmalloc(sizeof(*new) + new_map + max_fds * sizeof(struct file *));
+    if (!new)
+        return ENOMEM;
+
+    new->max_fds = max_fds;
+    new->open_fds = (uint32_t *)(new + 1);
+    new->fd_array = (struct file **)((char *)new->open_fds + new_map);
+    new->old = old;
+
+    memcpy(new->open_fds, old->open_fds, old_map);
+    bzero((char *)new->open_fds + old_map, new_map - old_map);
+    memcpy(new->fd_array, old->fd_array, old->max_fds * sizeof(struct file *));
+    bzero(&new->fd_array[old->max_fds], (max_fds - old->max_fds) * sizeof(struct file *));
+
+    membar_store_store();
+    WRITE_ONCE(ftable->fdt, new);
+
+    return 0;
+}
+
+/**
+ * @brief grows the table so that it can hold `fd`,
+ * within the current fd limit.
+ * 
+ * @return int EMFILE if over the fd limit, ENOMEM
+ */
+static int fd_table_expand(struct file_table *ftable, int fd)
+{
+    return fd_table_grow(ftable, fd, READ_ONCE(file_fd_limit));
+}
+
+/**
+ * @brief adds the file to the table at the lowest
+ * unused fd, the fd is also set in the file.
+ * 
+ * @param ftable file table
+ * @param file file to add
+ * @param fd returns the new fd
+ * @return int EMFILE if the table is full
+ */
+int file_table_alloc(struct file_table *ftable, struct file *file, int *fd)
+{
+    struct fd_table *fdt;
+    int newfd;
+    int retval;
+
+    KASSERT(ftable != NULL);
+    KASSERT(file != NULL);
+    KASSERT(refcount_read(&file->refcount) > 0);
+
+    lock_acquire(ftable->table_lock);
+
+    fdt = ftable->fdt;
+    newfd = fd_find_first_zero(fdt, READ_ONCE(file_fd_limit));
+    if (newfd < 0) {
+        /* the table is full, the first new slot is free */
+        newfd = fdt->max_fds;
+        retval = fd_table_expand(ftable, newfd);
+        if (retval) {
+            lock_release(ftable->table_lock);
+            return retval;
+        }
+        fdt = ftable->fdt;
+    }
+
+    KASSERT(fdt->fd_array[newfd] == NULL);
+    file->fd = newfd;
+    fd_mark(fdt, newfd);
+    fd_install(fdt, newfd, file);
+    ftable->open_files += 1;
+
+    lock_release(ftable->table_lock);
+
+    *fd = newfd;
+
+    return 0;
 }
 
 struct file_table *file_table_create(void)
 {
     struct file_table *ftable;
-    int fd;
 
     // TODO: remove kmalloc
     ftable = kmalloc(sizeof(struct file_table));
@@ -244,9 +607,16 @@ struct file_table *file_table_create(void)
         return NULL;
     }
 
-    for (fd = 0; fd < OPEN_MAX; fd++)
-        ftable->fd_array[fd] = NULL;
+    ftable->fdtab.max_fds = FD_TABLE_INIT;
+    ftable->fdtab.open_fds = ftable->open_fds_init;
+    ftable->fdtab.fd_array = ftable->fd_array_init;
+    ftable->fdtab.old = NULL;
+    ftable->fdt = &ftable->fdtab;
 
+    bzero(ftable->open_fds_init, sizeof(ftable->open_fds_init));
+    bzero(ftable->fd_array_init, sizeof(ftable->fd_array_init));
+
+    ftable->refcount = REFCOUNT_INIT(1);
     ftable->open_files = 0;
 
     return ftable;
@@ -254,15 +624,64 @@ struct file_table *file_table_create(void)
 
 void file_table_destroy(struct file_table *ftable)
 {
+    struct fd_table *fdt, *old;
+
     KASSERT(ftable != NULL);
     KASSERT(ftable->open_files == 0);
 
+    /* the embedded table is the last one */
+    for (fdt = ftable->fdt; fdt != &ftable->fdtab; fdt = old) {
+        old = fdt->old;
+        kfree(fdt);
+    }
+
     lock_destroy(ftable->table_lock);
     kfree(ftable);
 }
 
+/**
+ * @brief shares the table with a forked process,
+ * the process changing it first makes its own copy.
+ * 
+ * @param ftable table to share
+ * @return struct file_table* the same table
+ */
+struct file_table *file_table_share(struct file_table *ftable)
+{
+    KASSERT(ftable != NULL);
+
+    refcount_inc(&ftable->refcount);
+
+    return ftable;
+}
+
+/**
+ * @brief drops a reference to the table, the last
+ * one closes the files and destroys it.
+ * 
+ * @param ftable 
+ */
+void file_table_put(struct file_table *ftable)
+{
+    KASSERT(ftable != NULL);
+
+    if (refcount_dec(&ftable->refcount) > 0)
+        return;
+
+    file_table_clear(ftable);
+    file_table_destroy(ftable);
+}
+
+/**
+ * @brief installs the file in the slot of its fd,
+ * the table grows if the fd does not fit.
+ * 
+ * @return int EMFILE if the fd is over the limit, ENOMEM
+ */
 int file_table_add(struct file *file, struct file_table *head)
 {
+    int retval;
+
     KASSERT(file != NULL);
     KASSERT(head != NULL);
     /* file is still uninitialized */
@@ -271,13 +690,15 @@ int file_table_add(struct file *file, struct file_table *head)
 
     lock_acquire(head->table_lock);
 
-    if (head->open_files == OPEN_MAX) {
+    retval = fd_table_expand(head, file->fd);
+    if (retval) {
         lock_release(head->table_lock);
-        return EMFILE;
+        return retval;
     }
 
-    KASSERT(head->fd_array[file->fd] == NULL);
-    head->fd_array[file->fd] = file;
+    KASSERT(!fd_isset(head->fdt, file->fd));
+    fd_mark(head->fdt, file->fd);
+    fd_install(head->fdt, file->fd, file);
     head->open_files += 1;
 
     lock_release(head->table_lock);
@@ -287,6 +708,7 @@ int file_table_add(struct file *file, struct file_table *head)
 
 int file_table_remove(struct file_table *ftable, int fd)
 {
+    struct fd_table *fdt;
     struct file *file;
 
     KASSERT(ftable != NULL);
@@ -296,13 +718,15 @@ int file_table_remove(struct file_table *ftable, int fd)
 
     lock_acquire(ftable->table_lock);
 
-    file = ftable->fd_array[fd];
+    fdt = ftable->fdt;
+    file = (unsigned)fd < fdt->max_fds ? fdt->fd_array[fd] : NULL;
     if (!file) {
         lock_release(ftable->table_lock);
         return EBADF;
     }
 
-    ftable->fd_array[fd] = NULL;
+    WRITE_ONCE(fdt->fd_array[fd], NULL);
+    fd_unmark(fdt, fd);
     ftable->open_files -= 1;
 
     lock_release(ftable->table_lock);
@@ -313,50 +737,67 @@ int file_table_remove(struct file_table *ftable, int fd)
 }
 
 /**
- * @brief initialized the file table with
- * the basic 3 file descriptor of stdin,
- * stdout, stderr.
+ * @brief opens the console files shared by the new
+ * processes as stdin, stdout and stderr.
  * 
- * @param ftable 
- * @return int 
  */
-int file_table_init(struct file_table *ftable)
+void file_console_bootstrap(void)
 {
     int fd;
     int retval;
+    char console[5];
     struct vnode *console_vnode;
     struct file *console_file;
     int openflag[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
 
-    KASSERT(ftable->fd_array != NULL);
-    KASSERT(ftable->open_files == 0);
-
     for (fd = 0; fd < 3; fd++) {
         /*
          * The "con:" string when calling
-         * vfs_open represnt the console device
+         * vfs_open represnt the console device,
+         * vfs_open destroys the string
          */
-        char *console = kstrdup("con:");
-        if (!console) {
-            retval = ENOMEM;
-            goto out;
-        }
+        strcpy(console, "con:");
 
         retval = vfs_open(console, openflag[fd], 0, &console_vnode);
-        kfree(console);
         if (retval)
-            goto out;
+            panic("file_console_bootstrap: cannot open the console: %s\n",
+                  strerror(retval));
 
         console_file = file_create();
-        if (!console_file) {
-            vfs_close(console_vnode);
-            retval =  ENOMEM;
-            goto out;
-        }
+        if (!console_file)
+            panic("file_console_bootstrap: out of memory\n");
 
         console_file->fd = fd;
         console_file->vnode = console_vnode;
 
+        console_files[fd] = console_file;
+    }
+}
+
+/**
+ * @brief initialized the file table with
+ * the basic 3 file descriptor of stdin,
+ * stdout, stderr. The console files are
+ * shared, only a reference is taken.
+ * 
+ * @param ftable 
+ * @return int 
+ */
+int file_table_init(struct file_table *ftable)
+{
+    int fd;
+    int retval;
+    struct file *console_file;
+
+    KASSERT(ftable->fdt != NULL);
+    KASSERT(ftable->open_files == 0);
+
+    for (fd = 0; fd < 3; fd++) {
+        console_file = console_files[fd];
+        KASSERT(console_file != NULL);
+
+        refcount_inc(&console_file->refcount);
+
         retval = file_table_add(console_file, ftable);
         if (retval)
             goto bad_init_cleanup_file;
@@ -368,46 +809,113 @@ int file_table_init(struct file_table *ftable)
 
 bad_init_cleanup_file:
     file_destroy(console_file);
-out:
     file_table_clear(ftable);
     return retval;
 }
 
-struct file *file_table_get(struct file_table *head, int fd)
+/**
+ * @brief returns the file of the fd, without locking
+ * the table: the slots are published by `fd_install`
+ * after the file is initialized, and a grown table
+ * after its slots are copied. No reference is taken,
+ * the file can be closed as soon as it is returned.
+ * 
+ * @param head file table
+ * @param fd file descriptor
+ * @return struct file* the file or NULL if the fd is not open
+ */
+struct file *file_table_lookup(struct file_table *head, int fd)
 {
-    struct file *file;
+    struct fd_table *fdt;
 
-    if (fd < 0 || fd >= OPEN_MAX)
+    if (fd < 0)
         return NULL;
 
+    fdt = READ_ONCE(head->fdt);
+    if ((unsigned)fd >= fdt->max_fds)
+        return NULL;
+
+    return READ_ONCE(fdt->fd_array[fd]);
+}
+
+/**
+ * @brief returns the file of the fd with a reference
+ * taken, it stays valid even if the fd is closed by
+ * another thread. Release it with `file_put`.
+ * 
+ * @param head file table
+ * @param fd file descriptor
+ * @param exclusive the caller is the only thread that can
+ * remove files from the table, the table is not locked
+ * @return struct file* the file or NULL if the fd is not open
+ */
+struct file *file_table_get(struct file_table *head, int fd, bool exclusive)
+{
+    struct file *file;
+
+    if (exclusive) {
+        file = file_table_lookup(head, fd);
+        if (file)
+            refcount_inc(&file->refcount);
+        return file;
+    }
+
     lock_acquire(head->table_lock);
-    file = head->fd_array[fd];
+    file = file_table_lookup(head, fd);
+    if (file)
+        refcount_inc(&file->refcount);
     lock_release(head->table_lock);
 
-    // TODO: remember to increase refcount of file
     return file;
 }
 
 int file_table_dup2(struct file_table *ftable, int oldfd, int newfd)
 {
+    struct fd_table *fdt;
+    int retval;
+
     if (!check_fd(oldfd) || !check_fd(newfd))
         return EBADF;
 
     lock_acquire(ftable->table_lock);
 
-    struct file *old_file = ftable->fd_array[oldfd];
+    fdt = ftable->fdt;
+    struct file *old_file = (unsigned)oldfd < fdt->max_fds ? fdt->fd_array[oldfd] : NULL;
     if (!old_file) {
         lock_release(ftable->table_lock);
         return EBADF;
     }
 
-    struct file *new_file = ftable->fd_array[newfd];
+    /* nothing to do, and the file must not be released */
+    if (oldfd == newfd) {
+        lock_release(ftable->table_lock);
+        return 0;
+    }
+
+    /* an open fd can be replaced, a new one must be within the limit */
+    if ((unsigned)newfd >= READ_ONCE(file_fd_limit) &&
+        ((unsigned)newfd >= fdt->max_fds || !fdt->fd_array[newfd])) {
+        lock_release(ftable->table_lock);
+        return EBADF;
+    }
+
+    retval = fd_table_expand(ftable, newfd);
+    if (retval) {
+        lock_release(ftable->table_lock);
+        return retval;
+    }
+    fdt = ftable->fdt;
+
+    struct file *new_file = fdt->fd_array[newfd];
     if (new_file) {
         file_destroy(new_file);
+    } else {
+        fd_mark(fdt, newfd);
+        ftable->open_files += 1;
     }
     
     refcount_inc(&old_file->refcount);
-    ftable->fd_array[newfd] = old_file;
+    fd_install(fdt, newfd, old_file);
     
     lock_release(ftable->table_lock);
 
@@ -422,19 +930,28 @@ int file_table_dup2(struct file_table *ftable, int oldfd, int newfd)
  */
 void file_table_clear(struct file_table *ftable)
 {
-    int fd;
+    struct fd_table *fdt;
     struct file *file;
+    uint32_t used;
+    unsigned i;
+    int fd;
 
     lock_acquire(ftable->table_lock);
 
-    for (fd = 0; fd < OPEN_MAX && ftable->open_files > 0; fd++) {
-        file = ftable->fd_array[fd];
-        if (!file)
-            continue;
+    fdt = ftable->fdt;
+
+    for (i = 0; i < fdt->max_fds / FD_MAP_BITS && ftable->open_files > 0; i++) {
+        for (used = fdt->open_fds[i]; used != 0; used &= used - 1) {
+            fd = i * FD_MAP_BITS + __builtin_ctz(used);
+            file = fdt->fd_array[fd];
+            KASSERT(file != NULL);
+
+            WRITE_ONCE(fdt->fd_array[fd], NULL);
+            ftable->open_files -= 1;
+            file_destroy(file);
+        }
 
-        ftable->fd_array[fd] = NULL;
-        ftable->open_files -= 1;
-        file_destroy(file);
+        fdt->open_fds[i] = 0;
     }
 
     lock_release(ftable->table_lock);
@@ -446,7 +963,9 @@ void file_table_clear(struct file_table *ftable)
  * @brief copies the a file table to a new one
  * increasing the refcount of the inner files,
  * the inner files are not copyied only a reference
- * is kept inside the table.
+ * is kept inside the table. Only the populated range
+ * is walked, the copy is sized on the highest fd,
+ * whatever the current fd limit.
  * 
  * @param ftable the table to copy from
  * @param copy the file table has to uninitialized
@@ -454,33 +973,48 @@ void file_table_clear(struct file_table *ftable)
  */
 int file_table_copy(struct file_table *ftable, struct file_table *copy)
 {
+    struct fd_table *fdt, *copy_fdt;
     struct file *file;
-    int retval;
+    uint32_t used;
+    int retval = 0;
+    int last;
+    unsigned i;
     int fd;
 
+    KASSERT(copy->open_files == 0);
 
     lock_acquire(ftable->table_lock);
+    lock_acquire(copy->table_lock);
 
-    for (fd = 0; fd < OPEN_MAX; fd++) {
-        file = ftable->fd_array[fd];
-        if (!file)
-            continue;
-        
-        refcount_inc(&file->refcount);
+    fdt = ftable->fdt;
 
-        retval = file_table_add(file, copy);
-        if (retval)
-            goto out;
-    }
+    last = fd_find_last(fdt);
+    if (last < 0)
+        goto out;
 
-    lock_release(ftable->table_lock);
+    /* the fds already open stay valid under a lowered limit */
+    retval = fd_table_grow(copy, last, fdt->max_fds);
+    if (retval)
+        goto out;
 
-    KASSERT(copy->open_files == ftable->open_files);
+    copy_fdt = copy->fdt;
 
-    return 0;
+    for (i = 0; i <= (unsigned)last / FD_MAP_BITS; i++) {
+        for (used = fdt->open_fds[i]; used != 0; used &= used - 1) {
+            fd = i * FD_MAP_BITS + __builtin_ctz(used);
+            file = fdt->fd_array[fd];
+
+            refcount_inc(&file->refcount);
+            fd_install(copy_fdt, fd, file);
+        }
+
+        copy_fdt->open_fds[i] = fdt->open_fds[i];
+    }
+
+    copy->open_files = ftable->open_files;
 
-/* cleanup bad initialization */
 out:
+    lock_release(copy->table_lock);
     lock_release(ftable->table_lock);
     return retval;
-}
\ No newline at end of file
+}
@@ -52,9 +52,23 @@
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <slab.h>
+#include "opt-paging.h"
 
 
 
+/*
+ * Cache of the proc structures.
+ */
+static DEFINE_KMEM_CACHE(proc_cache, struct proc, NULL);
+
+#if OPT_SYSCALLS
+/*
+ * Cache of the user thread records.
+ */
+static DEFINE_KMEM_CACHE(uthread_cache, struct uthread, NULL);
+#endif // OPT_SYSCALLS
+
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  * 
@@ -67,38 +81,70 @@ struct proc kproc = {
 	.p_addrspace      = NULL,
 	.p_cwd            = NULL,
 #if OPT_SYSCALLS   
-	.wait_cv          = NULL,
-	.wait_lock        = NULL,
-	.wait_sem         = NULL,
     .state            = PROC_RUNNING,
     .exit_state       = PROC_RUNNING,
     .children         = LIST_HEAD_INIT(kproc.children),
 	.siblings         = LIST_HEAD_INIT(kproc.siblings),
 	.parent           = NULL,
     .pid              = 0,
-	.pid_link         = { .next = NULL, .pprev = NULL },
+	.p_uthreads       = LIST_HEAD_INIT(kproc.p_uthreads),
+	.p_next_tid       = 1,
+	.p_exiting        = false,
 #endif // OPT_SYSCALLS
 };
 
 #if OPT_SYSCALLS
-/**
- * Construct a new define hashtable object
+/*
+ * PID table, a two level radix tree indexed by the PID.
+ * A leaf is allocated when the first PID of its range
+ * is used, a lookup is always two loads.
  */
-DEFINE_HASHTABLE(proc_table, 5);
+#define PID_LEAF_BITS   (8)
+#define PID_LEAF_SIZE   (1 << PID_LEAF_BITS)
+#define PID_ROOT_SIZE   DIVROUNDUP(PID_MAX, PID_LEAF_SIZE)
+
+struct pid_leaf {
+	struct proc *procs[PID_LEAF_SIZE];
+};
+
+/* the first leaf holds the kernel process */
+static struct pid_leaf pid_leaf0;
+static struct pid_leaf *pid_table[PID_ROOT_SIZE] = { &pid_leaf0 };
 
 /*
- * Current next greater value of PID among the procs.
+ * Bitmap of the used PIDs and last allocated PID, the
+ * search for a free PID starts after it and wraps.
  */
-static pid_t max_pid = PID_MIN;
+#define PID_MAP_BITS    (sizeof(uint32_t) * 8)
+static uint32_t pid_map[DIVROUNDUP(PID_MAX, PID_MAP_BITS)];
+static pid_t last_pid = PID_MIN - 1;
 
 /*
  * Lock for pid manipulation:
- * - `max_pid`
- * - `proc_table`
+ * - `pid_map`
+ * - `last_pid`
+ * - `pid_table`
  * 
  */
 static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Slot of the PID in the table, NULL if its
+ * leaf is not allocated.
+ */
+static inline struct proc **pid_slot(pid_t pid)
+{
+	struct pid_leaf *leaf;
+
+	KASSERT(pid >= 0 && pid < PID_MAX);
+
+	leaf = pid_table[pid >> PID_LEAF_BITS];
+	if (!leaf)
+		return NULL;
+
+	return &leaf->procs[pid & (PID_LEAF_SIZE - 1)];
+}
+
 /*
  * Removes a child from the children
  * list of the parent, the list is locked
@@ -129,7 +175,7 @@ void add_new_child_proc(struct proc *new_child, struct proc *parent)
 /**
  * @brief Set the new parent for a `proc`. The requirements to
  * call this funcitons are to already own the p_lock for the
- * new parent and for the old parent.
+ * new parent, for the old parent and for the child.
  * 
  * @param child child to exchange parent
  * @param parent parent to remove the child from
@@ -139,8 +185,7 @@ static void proc_set_parent(struct proc *child, struct proc *parent, struct proc
 {
 	KASSERT(spinlock_do_i_hold(&new_parent->p_lock));
 	KASSERT(spinlock_do_i_hold(&parent->p_lock));
-
-	spinlock_acquire(&child->p_lock);
+	KASSERT(spinlock_do_i_hold(&child->p_lock));
 	KASSERT(child->parent == parent);
 
 	/* Set the new owner of the child */
@@ -153,8 +198,6 @@ static void proc_set_parent(struct proc *child, struct proc *parent, struct proc
 
 	/* List owned by new parent */
 	list_add_tail(&child->siblings, &new_parent->children);
-
-	spinlock_release(&child->p_lock);
 }
 
 // static struct proc *proc_get_parent(struct proc *proc)
@@ -176,17 +219,18 @@ static void proc_set_parent(struct proc *child, struct proc *parent, struct proc
 
 /**
  * @brief this function orphanizes all the children of a process
- * `proc`, all of it's children will be attached to the `kproc` process, 
- * and it will handle when to destroy them. This has to be done
- * because a process can only be destroyed by it's parent, but we cannot
- * destroy them here because a `wait()` was never called on them before the
- * `exit()` was. `kproc` will then destroy them when their status is to
- * `ZOMBIE`.
+ * `proc`, all of it's children will be attached to `orphanage`.
+ * Nobody can `wait()` for an orphan: the children that already
+ * exited are destroyed here, the others destroy themselves
+ * when they exit, see `proc_make_zombie`. The decision is
+ * taken under the child p_lock, so exactly one of the two
+ * reaps it.
  * 
  * @param proc proc to oprphanize all of it's children.
  */
 static void proc_orphanize_childeren(struct proc *proc)
 {
+	LIST_HEAD(zombies);
 	struct proc *child;
 	struct proc *temp;
 
@@ -194,55 +238,114 @@ static void proc_orphanize_childeren(struct proc *proc)
 	spinlock_acquire(&proc->p_lock);
 
 	proc_for_each_child(child, temp, proc) {
-		proc_set_parent(child, proc, &orphanage);
+		spinlock_acquire(&child->p_lock);
+
+		/* still the parent, `del_child_proc` removes it from the list */
+		if (child->state == PROC_ZOMBIE)
+			list_move_tail(&child->siblings, &zombies);
+		else
+			proc_set_parent(child, proc, &orphanage);
+
+		spinlock_release(&child->p_lock);
 	}
 
 	KASSERT(list_empty(&proc->children));
 
 	spinlock_release(&proc->p_lock);
 	spinlock_release(&orphanage.p_lock);
+
+	/*
+	 * The zombies released their p_lock as the last
+	 * access to the proc, they can be freed right away.
+	 */
+	list_for_each_entry_safe(child, temp, &zombies, siblings) {
+		proc_destroy(child);
+	}
 }
 
 void proc_make_zombie(int exit_code, struct proc *proc)
 {
+	bool orphan;
+
 	/* 
 	 * We need to attach all of the current childern 
-	 * to `kproc` before we can terminate the `exit()`
+	 * to `orphanage` before we can terminate the `exit()`
 	 * or set the state as ZOMBIE.
 	 */
 	proc_orphanize_childeren(proc);
 
-	lock_acquire(proc->wait_lock);
-	proc->exit_state = PROC_ZOMBIE;
+	/*
+	 * The exit status and the state are published in
+	 * one critical section. From here the parent can reap
+	 * the proc, if the parent already exited the proc is
+	 * an orphan and it is destroyed right away.
+	 */
+	spinlock_acquire(&proc->p_lock);
 	proc->exit_code = exit_code;
-	cv_broadcast(proc->wait_cv, proc->wait_lock);
-	lock_release(proc->wait_lock);
+	proc->exit_state = PROC_ZOMBIE;
+	proc->state = PROC_ZOMBIE;
+	orphan = proc->parent == &orphanage;
+	wchan_wakeall(&proc->p_wchan, &proc->p_lock);
+	/* last access to `proc` when it's not an orphan */
+	spinlock_release(&proc->p_lock);
 
-	/**
-	 * Without this signal the father can kill the current proc
-	 * when this hasn't come out of this funcion yet, thus causing
-	 * references to dangling pointers.
-	 */
-	V(proc->wait_sem);
+	if (orphan)
+		proc_destroy(proc);
 }
 
-struct proc *
-proc_get_child(pid_t pid, struct proc *proc)
+static struct proc *proc_get_from_pid(pid_t pid)
 {
-	struct proc *found = NULL;
-	struct proc *child;
+	struct proc **slot;
+
+	KASSERT(spinlock_do_i_hold(&pid_lock));
+
+	if (pid < 0 || pid >= PID_MAX)
+		return NULL;
+
+	slot = pid_slot(pid);
+
+	return slot ? *slot : NULL;
+}
+
+/**
+ * @brief Finds the child `pid` of `proc` and claims it for
+ * the caller, which has to pass it to `proc_check_zombie`.
+ * Only one thread of `proc` can wait for a child, the
+ * others would reap it again.
+ * 
+ * @param pid pid of the child
+ * @param proc parent
+ * @param child set to the child
+ * @return int ESRCH if `pid` is not a child of `proc`,
+ * ECHILD if another thread is already waiting for it
+ */
+int
+proc_get_child(pid_t pid, struct proc *proc, struct proc **child)
+{
+	struct proc *found;
+	int retval = 0;
 
 	spinlock_acquire(&pid_lock);
-	hash_for_each_possible(proc_table, child, pid_link, pid) {
-		if (child->pid != pid || child->parent != proc)
-			continue;
 
-		found = child;
-		break;
+	found = proc_get_from_pid(pid);
+	if (!found || found->parent != proc) {
+		retval = ESRCH;
+		goto out;
 	}
+
+	spinlock_acquire(&proc->p_lock);
+	if (found->p_waited)
+		retval = ECHILD;
+	else
+		found->p_waited = true;
+	spinlock_release(&proc->p_lock);
+
+	*child = found;
+
+out:
 	spinlock_release(&pid_lock);
 
-	return found;
+	return retval;
 }
 
 /**
@@ -250,49 +353,54 @@ proc_get_child(pid_t pid, struct proc *proc)
  * it will be destroyed. Depending on the options it can return in a
  * non-blocking way.
  * 
- * @param child child of `proc` to check it's `exit_state`,
+ * @param child child of `proc` to check it's `exit_state`, claimed
+ * with `proc_get_child` unless the caller is its only possible waiter,
  * if return value is not 0 this pointer becomes dangling
  * @param wstatus set the `exit_code` of the child
  * @param options `waitpid()` options
  * @param proc parent of `child`
  * @return pid_t return the `pid_t` of the child. If `WNOHANG` is set on
  * the options and if the child has not exited yet, it will return 0.
+ * It returns -1 if `proc` is being torn down while waiting.
  */
 pid_t proc_check_zombie(struct proc *child, int *wstatus, int options, struct proc *proc)
 {
-	// TODO: `proc` should be locked
-	(void)proc;
 	pid_t retval = child->pid;
 
 	KASSERT(retval != 0);
 	(void)options;
 
 	bool no_hang = (options & WNOHANG) != 0;
+	int exit_code;
 
-	lock_acquire(child->wait_lock);
+	spinlock_acquire(&child->p_lock);
 	while (child->exit_state != PROC_ZOMBIE) {
 		if (no_hang) {
 			retval = 0;
 			break;
 		}
 
-		cv_wait(child->wait_cv, child->wait_lock);
+		/* woken up by proc_interrupt_sleepers() */
+		if (proc_stopping(proc)) {
+			retval = -1;
+			break;
+		}
+
+		wchan_sleep(&child->p_wchan, &child->p_lock);
 	}
-	lock_release(child->wait_lock);
+	exit_code = child->exit_code;
+	spinlock_release(&child->p_lock);
 
-	/* With WNOHANG, child has not exited yet. */
-	if (retval == 0)
+	/* With WNOHANG, child has not exited yet, or interrupted. */
+	if (retval <= 0) {
+		spinlock_acquire(&proc->p_lock);
+		child->p_waited = false;
+		spinlock_release(&proc->p_lock);
 		return retval;
-
-	/**
-	 * Without this signal the father can kill the child proc
-	 * when it hasn't exited yet, thus causing
-	 * references to dangling pointers.
-	 */
-	P(child->wait_sem);
+	}
 
 	if (wstatus) {
-		*wstatus = child->exit_code;
+		*wstatus = exit_code;
 	}
 
 	// TODO: move this
@@ -301,66 +409,273 @@ pid_t proc_check_zombie(struct proc *child, int *wstatus, int options, struct pr
 	return retval;
 }
 
-static struct proc *proc_get_from_pid(pid_t pid)
+/**
+ * @brief Calls `f` on every process of the PID table,
+ * the table is locked with a spinlock so `f` must not
+ * sleep and the procs can't be referenced after it
+ * returns.
+ * 
+ * @param f function to call
+ * @param private argument passed to `f`
+ */
+void proc_for_each_process(void (*f)(struct proc *proc, void *private), void *private)
+{
+	struct pid_leaf *leaf;
+	unsigned i, j;
+
+	spinlock_acquire(&pid_lock);
+	for (i = 0; i < PID_ROOT_SIZE; i++) {
+		leaf = pid_table[i];
+		if (!leaf)
+			continue;
+
+		for (j = 0; j < PID_LEAF_SIZE; j++) {
+			if (leaf->procs[j])
+				f(leaf->procs[j], private);
+		}
+	}
+	spinlock_release(&pid_lock);
+}
+
+/**
+ * @brief Wakes up the threads of `proc` sleeping in the kernel,
+ * so that they see `p_exiting` or `p_killed` and give up:
+ * thread_join() sleeps on the wchan of `proc`, waitpid() on the
+ * one of a child. The console reads are woken by con_interrupt().
+ * 
+ * @param proc process, its p_lock is held by the caller
+ */
+static void proc_interrupt_sleepers(struct proc *proc)
+{
+	struct proc *child, *temp;
+
+	KASSERT(spinlock_do_i_hold(&proc->p_lock));
+
+	wchan_wakeall(&proc->p_wchan, &proc->p_lock);
+
+	proc_for_each_child(child, temp, proc) {
+		spinlock_acquire(&child->p_lock);
+		wchan_wakeall(&child->p_wchan, &child->p_lock);
+		spinlock_release(&child->p_lock);
+	}
+}
+
+/**
+ * @brief Marks a process to be terminated, it will call
+ * `_exit()` the next time it returns to userland.
+ * 
+ * @param pid pid of the process
+ * @return int ESRCH if the process does not exist
+ */
+int proc_kill(pid_t pid)
 {
 	struct proc *proc;
+	int retval = 0;
 
-	KASSERT(spinlock_do_i_hold(&pid_lock));
+	spinlock_acquire(&pid_lock);
 
-	hash_for_each_possible(proc_table, proc, pid_link, pid) {
-		if (proc->pid == pid)
-			return proc;
+	proc = proc_get_from_pid(pid);
+	if (!proc || proc == &kproc) {
+		retval = ESRCH;
+		goto out;
 	}
 
-	return NULL;
+	spinlock_acquire(&proc->p_lock);
+	proc->p_killed = true;
+	proc_interrupt_sleepers(proc);
+	spinlock_release(&proc->p_lock);
+
+out:
+	spinlock_release(&pid_lock);
+
+	if (!retval)
+		con_interrupt();
+
+	return retval;
+}
+
+#if OPT_PAGING
+/**
+ * @brief Sets the resident pages limit of a process.
+ *
+ * @param pid pid of the process
+ * @param pages new limit, 0 for a fair share of the memory
+ * @return int ESRCH if the process does not exist or has
+ * no address space
+ */
+int proc_set_rss_limit(pid_t pid, size_t pages)
+{
+	struct proc *proc;
+	int retval = 0;
+
+	spinlock_acquire(&pid_lock);
+
+	proc = proc_get_from_pid(pid);
+	if (!proc || proc == &kproc) {
+		retval = ESRCH;
+		goto out;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	if (proc->p_addrspace)
+		as_set_rss_limit(proc->p_addrspace, pages);
+	else
+		retval = ESRCH;
+	spinlock_release(&proc->p_lock);
+
+out:
+	spinlock_release(&pid_lock);
+
+	return retval;
+}
+
+static void proc_print_mem(struct proc *proc, void *private)
+{
+	struct addrspace *as;
+
+	(void)private;
+
+	spinlock_acquire(&proc->p_lock);
+
+	as = proc->p_addrspace;
+	if (as) {
+		kprintf("%6d %8u %8u %8u %8u %8u %6u %c %s\n",
+			proc->pid,
+			as->pt.total_pages,
+			as->pt.swap_pages,
+			as->pt.table_pages,
+			as_rss_limit(as),
+			as->wss_pages,
+			as->pff,
+			proc->p_killed ? 'K' : ' ',
+			proc->p_name);
+	}
+
+	spinlock_release(&proc->p_lock);
+}
+
+/**
+ * @brief Prints the memory used by each user process:
+ * resident pages, swapped pages, page table pages, resident
+ * limit, working set estimate and page fault frequency.
+ */
+void proc_print_mem_info(void)
+{
+	kprintf("%6s %8s %8s %8s %8s %8s %6s   %s\n",
+		"pid", "resident", "swapped", "ptables", "limit", "wss", "pff", "name");
+
+	proc_for_each_process(proc_print_mem, NULL);
+}
+#endif // OPT_PAGING
+
+static inline void pid_mark(pid_t pid)
+{
+	pid_map[pid / PID_MAP_BITS] |= 1U << (pid % PID_MAP_BITS);
+}
+
+static inline void pid_unmark(pid_t pid)
+{
+	pid_map[pid / PID_MAP_BITS] &= ~(1U << (pid % PID_MAP_BITS));
+}
+
+/**
+ * @brief Finds the first free PID in [start, end),
+ * skipping a whole word of the bitmap when it is full.
+ * 
+ * @return pid_t the PID or -1 if there is none
+ */
+static pid_t pid_find_free(pid_t start, pid_t end)
+{
+	uint32_t free_bits;
+	pid_t pid, i;
+
+	for (pid = start; pid < end; pid = (i + 1) * PID_MAP_BITS) {
+		i = pid / PID_MAP_BITS;
+
+		/* the PIDs of the word below `pid` are not candidates */
+		free_bits = ~(pid_map[i] | ((1U << (pid % PID_MAP_BITS)) - 1));
+		if (free_bits == 0)
+			continue;
+
+		pid = i * PID_MAP_BITS + __builtin_ctz(free_bits);
+		return pid < end ? pid : -1;
+	}
+
+	return -1;
 }
 
 static inline void free_pid(struct proc *proc)
 {
+	struct proc **slot;
+
 	spinlock_acquire(&pid_lock);
-	hash_del(&proc->pid_link);
+
+	slot = pid_slot(proc->pid);
+	if (slot && *slot == proc)
+		*slot = NULL;
+
+	pid_unmark(proc->pid);
+
 	spinlock_release(&pid_lock);
 
 	proc->pid = -1;
 }
 
 /**
- * Get the next greater pid.
+ * Get the next free pid after the last one allocated,
+ * fails only when all the PIDs are in use.
 */
 static inline pid_t __must_check alloc_pid(void) 
 {
-    pid_t pid;
-	pid_t next_max;
+	pid_t pid;
     
 	spinlock_acquire(&pid_lock);
-	pid = max_pid;
 
-	/* Fail if the pid already exist */
-	if (proc_get_from_pid(pid)) {
-		pid = -1;
-		goto out;
-	}
+	pid = pid_find_free(last_pid + 1, PID_MAX);
+	if (pid == -1)
+		pid = pid_find_free(PID_MIN, last_pid + 1);
 
-	next_max = pid + 1;
-    if (next_max >= PID_MAX || next_max < PID_MIN)
-        next_max = PID_MIN;
-	max_pid = next_max;
+	if (pid != -1) {
+		pid_mark(pid);
+		last_pid = pid;
+	}
 
-out:
 	spinlock_release(&pid_lock);
 
-    return pid;
+	return pid;
 }
 
 /**
- * Insert a new proc to the list of processes
- * and to the PID table.
+ * Insert a new proc to the PID table, its pid
+ * must be allocated with `alloc_pid`.
  */
-static inline void insert_proc(struct proc *new)
+static inline int insert_proc(struct proc *new)
 {
+	unsigned index = new->pid >> PID_LEAF_BITS;
+	struct pid_leaf *leaf = NULL;
+
+	/* the leaf is allocated before taking the spinlock */
+	if (!READ_ONCE(pid_table[index])) {
+		leaf = kmalloc(sizeof(*leaf));
+		if (!leaf)
+			return ENOMEM;
+
+		bzero(leaf, sizeof(*leaf));
+	}
+
 	spinlock_acquire(&pid_lock);
-	hash_add(proc_table, &new->pid_link, new->pid);
+	if (!pid_table[index]) {
+		pid_table[index] = leaf;
+		leaf = NULL;
+	}
+	*pid_slot(new->pid) = new;
 	spinlock_release(&pid_lock);
+
+	/* another process allocated the leaf */
+	if (leaf)
+		kfree(leaf);
+
+	return 0;
 }
 #endif // OPT_SYSCALLS
 
@@ -387,20 +702,19 @@ __proc_destroy(struct proc *proc)
 	// TODO: implemet this when the init proc will receive zombie children
 	KASSERT(list_empty(&proc->children));
 	KASSERT(list_empty(&proc->siblings));
+	KASSERT(list_empty(&proc->p_uthreads));
 
-	cv_destroy(proc->wait_cv);
-	lock_destroy(proc->wait_lock);
-	sem_destroy(proc->wait_sem);
+	wchan_cleanup(&proc->p_wchan);
 #endif // OPT_SYSCALLS
 
 #if OPT_SYSFS
-	/* clear the file left unclosed */
-	file_table_clear(proc->ftable);
-	file_table_destroy(proc->ftable);
+	/* clear the file left unclosed, if not shared */
+	if (proc->ftable)
+		file_table_put(proc->ftable);
 #endif // OPT_SYSFS
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 }
 
 /*
@@ -415,7 +729,7 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL)
 		return NULL;
 
@@ -424,26 +738,15 @@ proc_create(const char *name)
 		goto create_out;
 
 #if OPT_SYSCALLS
-	proc->wait_cv = cv_create("wait_cv");
-	if (!proc->wait_cv)
-		goto bad_create_cleanup_name;
-
-	proc->wait_lock = lock_create("wait_lock");
-	if (!proc->wait_lock)
-		goto bad_create_cleanup_cv;
-
-	proc->wait_sem = sem_create("wait_sem", 0);
-	if (!proc->wait_sem)
-		goto bad_create_cleanup_lock;
+	wchan_init(&proc->p_wchan, "wait");
 
 #if OPT_SYSFS
-	proc->ftable = file_table_create();
-	if (!proc->ftable)
-		goto bad_create_cleanup_sem;
+	/* created or shared by the caller */
+	proc->ftable = NULL;
 #endif // OPT_SYSFS
 
 	proc->pid = -1;
-	INIT_HLIST_NODE(&proc->pid_link);
+	proc->p_killed = false;
 
 	/*
 	 * The new process is not running yet, this
@@ -456,9 +759,14 @@ proc_create(const char *name)
 	proc->exit_code = 0;
 
 	proc->parent = curproc;
+	proc->p_waited = false;
 
 	INIT_LIST_HEAD(&proc->children);
 	INIT_LIST_HEAD(&proc->siblings);
+
+	INIT_LIST_HEAD(&proc->p_uthreads);
+	proc->p_next_tid = 1;
+	proc->p_exiting = false;
 #endif // OPT_SYSCALLS
 
 	proc->p_numthreads = 0;
@@ -472,24 +780,8 @@ proc_create(const char *name)
 
 	return proc;
 
-#if OPT_SYSCALLS
-#if OPT_SYSFS
-bad_create_cleanup_sem:
-	sem_destroy(proc->wait_sem);
-#endif // OPT_SYSFS
-
-bad_create_cleanup_lock:
-	lock_destroy(proc->wait_lock);
-
-bad_create_cleanup_cv:
-	cv_destroy(proc->wait_cv);
-#endif // OPT_SYSCALLS
-
-bad_create_cleanup_name:
-	kfree(proc->p_name);
-
 create_out:
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 	return NULL;
 }
 
@@ -598,11 +890,8 @@ proc_bootstrap(void)
 	 */
 
 #if OPT_SYSCALLS
-	// TODO: make synch static
-	kproc.wait_cv = cv_create("wait_cv");
-	kproc.wait_lock = lock_create("wait_lock");
-	kproc.wait_sem = sem_create("wait_sem", 0);
-	hash_add(proc_table, &kproc.pid_link, kproc.pid);
+	wchan_init(&kproc.p_wchan, "wait");
+	*pid_slot(kproc.pid) = &kproc;
 #endif // OPT_SYSCALLS
 }
 
@@ -633,7 +922,10 @@ proc_create_runprogram(const char *name)
 		return NULL;
 
 	newproc->pid = pid;
-	insert_proc(newproc);
+	if (insert_proc(newproc)) {
+		free_pid(newproc);
+		return NULL;
+	}
 
 	add_new_child_proc(newproc, curproc);
 #endif // OPT_SYSCALLS
@@ -653,6 +945,10 @@ proc_create_runprogram(const char *name)
 	spinlock_release(&curproc->p_lock);
 
 #if OPT_SYSFS
+	newproc->ftable = file_table_create();
+	if (!newproc->ftable)
+		return NULL;
+
 	file_table_init(newproc->ftable);
 #endif // OPT_SYSFS
 
@@ -667,6 +963,9 @@ struct proc *
 proc_copy(void)
 {
 	struct proc *curr, *new_proc;
+#if OPT_SYSFS
+	struct file_table *ftable;
+#endif // OPT_SYSFS
 	pid_t pid;
 	int err;
 
@@ -681,23 +980,40 @@ proc_copy(void)
 	if (err)
 		goto fork_out;
 
+#if OPT_SYSFS
+	/*
+	 * Copied when one of the two processes changes it, but
+	 * the table of a multithreaded process is never shared,
+	 * see proc_uthread_create().
+	 */
+	if (!proc_multithreaded(curr)) {
+		new_proc->ftable = file_table_share(curr->ftable);
+	} else {
+		ftable = file_table_create();
+		if (!ftable)
+			goto bad_as_cleanup;
+
+		err = file_table_copy(curr->ftable, ftable);
+		if (err) {
+			file_table_destroy(ftable);
+			goto bad_as_cleanup;
+		}
+		new_proc->ftable = ftable;
+	}
+#endif // OPT_SYSFS
+
 #if OPT_SYSCALLS
 	new_proc->parent = curr;
 	add_new_child_proc(new_proc, curr);
 
 	pid = alloc_pid();
 	if (pid == -1)
-		goto bad_as_cleanup;
+		goto bad_child_cleanup;
 
 	new_proc->pid = pid;
-	insert_proc(new_proc);
-#endif // OPT_SYSCALLS
-
-#if OPT_SYSFS
-	err = file_table_copy(curr->ftable, new_proc->ftable);
-	if (err)
+	if (insert_proc(new_proc))
 		goto bad_pid_cleanup;
-#endif // OPT_SYSFS
+#endif // OPT_SYSCALLS
 
 	/*
 	 * Lock the current process to copy its current directory.
@@ -713,14 +1029,17 @@ proc_copy(void)
 
 	return new_proc;
 
-bad_pid_cleanup:
 #if OPT_SYSCALLS
+bad_pid_cleanup:
 	free_pid(new_proc);
+
+bad_child_cleanup:
 	del_child_proc(new_proc);
-#endif // OPT_SYSCALL
+#endif // OPT_SYSCALLS
 
 bad_as_cleanup:
 	as_destroy(new_proc->p_addrspace);
+	new_proc->p_addrspace = NULL;
 
 fork_out:
 	__proc_destroy(new_proc);
@@ -786,10 +1105,9 @@ proc_remthread(struct thread *t)
 /*
  * Fetch the address space of (the current) process.
  *
- * Caution: address spaces aren't refcounted. If you implement
- * multithreaded processes, make sure to set up a refcount scheme or
- * some other method to make this safe. Otherwise the returned address
- * space might disappear under you.
+ * Address spaces aren't refcounted: the threads of a process share
+ * it, `_exit()` and execv() replace it only after proc_stop_threads()
+ * left the caller as the only thread of the process.
  */
 struct addrspace *
 proc_getas(void)
@@ -827,26 +1145,57 @@ proc_setas(struct addrspace *newas)
 }
 
 #if OPT_SYSFS
+/**
+ * @brief gives the process its own copy of the file
+ * table, if it still shares it after a fork. Called
+ * before any change to the table.
+ * 
+ * @param proc 
+ * @return int ENOMEM if the copy can not be allocated
+ */
+static int proc_unshare_files(struct proc *proc)
+{
+	struct file_table *ftable = proc->ftable;
+	struct file_table *copy;
+	int retval;
+
+	if (!file_table_shared(ftable))
+		return 0;
+
+	copy = file_table_create();
+	if (!copy)
+		return ENOMEM;
+
+	retval = file_table_copy(ftable, copy);
+	if (retval) {
+		file_table_destroy(copy);
+		return retval;
+	}
+
+	WRITE_ONCE(proc->ftable, copy);
+	file_table_put(ftable);
+
+	return 0;
+}
+
 /**
  * @brief adds a new file to the file table inside
- * the process
+ * the process, at the lowest free fd
  * 
  * @param proc 
  * @param file 
- * @return int 
+ * @param fd returns the fd of the file
+ * @return int EMFILE if the table is full
  */
-int proc_add_new_file(struct proc *proc, struct file *file)
+int proc_add_new_file(struct proc *proc, struct file *file, int *fd)
 {
-	struct file_table *ftable = proc->ftable;
-	int fd;
+	int retval;
 
-	// TOOD: modify fd assignment
-	fd = file_next_fd(ftable);
-	file->fd = fd;
-	// TODO: aggiungere gestione errore
-	file_table_add(file, ftable);
+	retval = proc_unshare_files(proc);
+	if (retval)
+		return retval;
 
-	return fd;
+	return file_table_alloc(proc->ftable, file, fd);
 }
 
 /**
@@ -859,11 +1208,45 @@ int proc_add_new_file(struct proc *proc, struct file *file)
  */
 int proc_removed_file(struct proc *proc, int fd)
 {
+	int retval;
+
+	/* do not copy the table for a bad fd */
+	if (!file_table_lookup(proc->ftable, fd))
+		return EBADF;
+
+	retval = proc_unshare_files(proc);
+	if (retval)
+		return retval;
+
 	return file_table_remove(proc->ftable, fd);
 }
 
 /**
- * @brief return the file from it's file descriptor
+ * @brief duplicates oldfd in newfd, in the process
+ * file table.
+ * 
+ * @param proc 
+ * @param oldfd 
+ * @param newfd 
+ * @return int 
+ */
+int proc_dup2_file(struct proc *proc, int oldfd, int newfd)
+{
+	int retval;
+
+	if (!file_table_lookup(proc->ftable, oldfd))
+		return EBADF;
+
+	retval = proc_unshare_files(proc);
+	if (retval)
+		return retval;
+
+	return file_table_dup2(proc->ftable, oldfd, newfd);
+}
+
+/**
+ * @brief return the file from it's file descriptor, with
+ * a reference taken, release it with `file_put`.
  * 
  * @param fd 
  * @return struct file* return the file it exist
@@ -871,6 +1254,216 @@ int proc_removed_file(struct proc *proc, int fd)
  */
 struct file *proc_get_file(struct proc *proc, int fd)
 {
-	return file_table_get(proc->ftable, fd);
+	/* only the threads of `proc` remove files from its table */
+	return file_table_get(proc->ftable, fd, !proc_multithreaded(proc));
 }
-#endif // OPT_SYSFS
\ No newline at end of file
+#endif // OPT_SYSFS
+
+#if OPT_SYSCALLS
+/**
+ * @brief Allocates the record of a new user thread of `proc`.
+ * The file table of a multithreaded process is never shared
+ * with another process, its threads would race replacing it
+ * in proc_unshare_files().
+ * 
+ * @param proc process of the new thread
+ * @param ret record of the thread, linked in `p_uthreads`
+ * @return int ENOMEM, EINTR if the process is exiting
+ */
+int proc_uthread_create(struct proc *proc, struct uthread **ret)
+{
+	struct uthread *ut;
+#if OPT_SYSFS
+	int retval;
+
+	retval = proc_unshare_files(proc);
+	if (retval)
+		return retval;
+#endif // OPT_SYSFS
+
+	ut = kmem_cache_alloc(&uthread_cache);
+	if (!ut)
+		return ENOMEM;
+
+	INIT_LIST_HEAD(&ut->ut_list);
+	ut->ut_stack = 0;
+	ut->ut_exited = false;
+	ut->ut_joining = false;
+	ut->ut_status = 0;
+
+	spinlock_acquire(&proc->p_lock);
+	if (proc->p_exiting || proc->p_killed) {
+		spinlock_release(&proc->p_lock);
+		kmem_cache_free(&uthread_cache, ut);
+		return EINTR;
+	}
+
+	ut->ut_tid = proc->p_next_tid++;
+	list_add_tail(&ut->ut_list, &proc->p_uthreads);
+	spinlock_release(&proc->p_lock);
+
+	*ret = ut;
+
+	return 0;
+}
+
+/**
+ * @brief Frees the record of a thread that never started.
+ * 
+ * @param proc process of the thread
+ * @param ut record returned by proc_uthread_create()
+ */
+void proc_uthread_destroy(struct proc *proc, struct uthread *ut)
+{
+	spinlock_acquire(&proc->p_lock);
+	list_del_init(&ut->ut_list);
+	spinlock_release(&proc->p_lock);
+
+	kmem_cache_free(&uthread_cache, ut);
+}
+
+/**
+ * @brief Detaches the current thread from `proc` and publishes
+ * its exit status for thread_join(). The last thread of the
+ * process is not detached, it has to go through `_exit()`.
+ * 
+ * @param proc process of the current thread
+ * @param status value handed to thread_join()
+ * @return true if the thread was detached, the caller can
+ * only call thread_stop()
+ */
+bool proc_uthread_exit(struct proc *proc, int status)
+{
+	struct thread *cur = curthread;
+	struct uthread *ut = cur->t_uthread;
+
+	KASSERT(cur->t_proc == proc);
+
+	spinlock_acquire(&proc->p_lock);
+	if (proc->p_numthreads == 1) {
+		spinlock_release(&proc->p_lock);
+		return false;
+	}
+
+	if (ut) {
+		ut->ut_exited = true;
+		ut->ut_status = status;
+	}
+
+	proc->p_numthreads--;
+	cur->t_uthread = NULL;
+	/* interrupts are off while holding the spinlock */
+	cur->t_proc = NULL;
+
+	wchan_wakeall(&proc->p_wchan, &proc->p_lock);
+	/* last access to `proc`, it can be destroyed from here */
+	spinlock_release(&proc->p_lock);
+
+	return true;
+}
+
+/**
+ * @brief Waits for the user thread `tid` of `proc`
+ * to exit and releases its record.
+ * 
+ * @param proc process of the current thread
+ * @param tid thread to wait for
+ * @param status set to the value passed to thread_exit()
+ * @return int ESRCH if there is no such thread, EINVAL when
+ * joining itself or a thread already joined by another one,
+ * EINTR if the process is exiting
+ */
+int proc_uthread_join(struct proc *proc, int tid, int *status)
+{
+	struct uthread *ut = NULL, *entry;
+	int retval = 0;
+
+	spinlock_acquire(&proc->p_lock);
+
+	list_for_each_entry(entry, &proc->p_uthreads, ut_list) {
+		if (entry->ut_tid == tid) {
+			ut = entry;
+			break;
+		}
+	}
+
+	if (!ut) {
+		retval = ESRCH;
+		goto out;
+	}
+
+	if (ut == curthread->t_uthread || ut->ut_joining) {
+		retval = EINVAL;
+		goto out;
+	}
+
+	ut->ut_joining = true;
+	while (!ut->ut_exited) {
+		if (proc_stopping(proc)) {
+			ut->ut_joining = false;
+			retval = EINTR;
+			goto out;
+		}
+
+		wchan_sleep(&proc->p_wchan, &proc->p_lock);
+	}
+
+	list_del_init(&ut->ut_list);
+	*status = ut->ut_status;
+
+out:
+	spinlock_release(&proc->p_lock);
+
+	if (!retval)
+		kmem_cache_free(&uthread_cache, ut);
+
+	return retval;
+}
+
+/**
+ * @brief Leaves the current thread as the only one of `proc`.
+ * The others are flagged and leave the next time they return
+ * to userland, the ones sleeping in thread_join(), waitpid()
+ * or a console read are woken up and their call fails with
+ * EINTR. The records of the user threads are released.
+ * 
+ * @param proc process of the current thread
+ * @param exiting the process is going away, otherwise it
+ * can create threads again once this returns (execv())
+ * @return false if another thread is already stopping the
+ * others, the caller has to leave with proc_uthread_exit()
+ */
+bool proc_stop_threads(struct proc *proc, bool exiting)
+{
+	LIST_HEAD(records);
+	struct uthread *ut, *temp;
+
+	spinlock_acquire(&proc->p_lock);
+	if (proc->p_exiting) {
+		spinlock_release(&proc->p_lock);
+		return false;
+	}
+
+	proc->p_exiting = true;
+	proc_interrupt_sleepers(proc);
+	spinlock_release(&proc->p_lock);
+
+	con_interrupt();
+
+	spinlock_acquire(&proc->p_lock);
+	while (proc->p_numthreads > 1)
+		wchan_sleep(&proc->p_wchan, &proc->p_lock);
+
+	list_splice_init(&proc->p_uthreads, &records);
+	curthread->t_uthread = NULL;
+	proc->p_exiting = exiting;
+	spinlock_release(&proc->p_lock);
+
+	list_for_each_entry_safe(ut, temp, &records, ut_list) {
+		list_del_init(&ut->ut_list);
+		kmem_cache_free(&uthread_cache, ut);
+	}
+
+	return true;
+}
+#endif // OPT_SYSCALLS
@@ -23,7 +23,7 @@ int sys_dup2(int oldfd, int newfd)
     struct proc *proc = curproc;
     KASSERT(proc != NULL);
 
-    return file_table_dup2(proc->ftable, oldfd, newfd);
+    return proc_dup2_file(proc, oldfd, newfd);
 }
 
 int sys_write(int fd, const_userptr_t buf, size_t nbyte, size_t *size_wrote)
@@ -31,8 +31,7 @@ int sys_write(int fd, const_userptr_t buf, size_t nbyte, size_t *size_wrote)
 #if OPT_SYSFS
     struct proc *curr;
     struct file *file;
-    void *kbuf;
-    int result;
+    int retval;
 
     KASSERT(curproc != NULL);
 
@@ -42,20 +41,10 @@ int sys_write(int fd, const_userptr_t buf, size_t nbyte, size_t *size_wrote)
     if (!file)
         return EBADF;
 
-    kbuf = kmalloc(nbyte);
-    if (!kbuf)
-        return ENOMEM;
-
-    /* copy from userspace to kernel buffer */
-    result = copyin(buf, kbuf, nbyte);
-    if (result)
-        goto out;
+    retval = file_write(file, buf, nbyte, size_wrote);
 
-    result = file_write(file, kbuf, nbyte, size_wrote);
-
-out:
-    kfree(kbuf);
-    return result;
+    file_put(file);
+    return retval;
 #else // OPT_SYSFS
     if (fd != STDOUT_FILENO && fd != STDERR_FILENO)
     {
@@ -77,8 +66,7 @@ int sys_read(int fd, userptr_t buf, size_t nbyte, size_t *size_read)
 #if OPT_SYSFS
     struct proc *curr;
     struct file *file;
-    void *kbuf;
-    int result;
+    int retval;
 
     KASSERT(curproc != NULL);
 
@@ -88,19 +76,10 @@ int sys_read(int fd, userptr_t buf, size_t nbyte, size_t *size_read)
     if (!file)
         return EBADF;
 
-    kbuf = kmalloc(nbyte);
-    if (!kbuf)
-        return ENOMEM;
-
-    result = file_read(file, kbuf, nbyte, size_read);
-    if (result)
-        goto out;
-
-    result = copyout(kbuf, buf, nbyte);
+    retval = file_read(file, buf, nbyte, size_read);
 
-out:
-    kfree(kbuf);
-    return result;
+    file_put(file);
+    return retval;
 #else // OPT_SYSFS
     if (fd != STDOUT_FILENO && fd != STDERR_FILENO)
     {
@@ -117,6 +96,136 @@ out:
 #endif // OPT_SYSFS
 }
 
+#if OPT_SYSFS
+/*
+ * Vectors up to FAST_IOV_MAX entries are copied on
+ * the stack, the larger ones are allocated.
+ */
+#define FAST_IOV_MAX    8
+
+/**
+ * @brief copies the iovec array of a vectored I/O
+ * from userspace, `fast_iov` is used if large enough.
+ * 
+ * @param uiov user array
+ * @param iovcnt number of entries
+ * @param fast_iov array of FAST_IOV_MAX entries
+ * @param iov returns the kernel copy, release it with `iov_free`
+ * @return int error if any
+ */
+static int iov_copyin(const_userptr_t uiov, int iovcnt,
+                      struct iovec *fast_iov, struct iovec **iov)
+{
+    int retval;
+
+    if (iovcnt <= 0 || iovcnt > IOV_MAX)
+        return EINVAL;
+
+    *iov = fast_iov;
+    if (iovcnt > FAST_IOV_MAX) {
+        *iov = kmalloc(iovcnt * sizeof(struct iovec));
+        if (!*iov)
+            return ENOMEM;
+    }
+
+    retval = copyin(uiov, *iov, iovcnt * sizeof(struct iovec));
+    if (retval && *iov != fast_iov)
+        kfree(*iov);
+
+    return retval;
+}
+
+static inline void iov_free(struct iovec *iov, struct iovec *fast_iov)
+{
+    if (iov != fast_iov)
+        kfree(iov);
+}
+
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, size_t *size_read)
+{
+    struct iovec fast_iov[FAST_IOV_MAX];
+    struct iovec *kiov;
+    struct file *file;
+    int retval;
+
+    KASSERT(curproc != NULL);
+
+    file = proc_get_file(curproc, fd);
+    if (!file)
+        return EBADF;
+
+    retval = iov_copyin(iov, iovcnt, fast_iov, &kiov);
+    if (retval)
+        goto out;
+
+    retval = file_readv(file, kiov, iovcnt, size_read);
+
+    iov_free(kiov, fast_iov);
+out:
+    file_put(file);
+    return retval;
+}
+
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, size_t *size_wrote)
+{
+    struct iovec fast_iov[FAST_IOV_MAX];
+    struct iovec *kiov;
+    struct file *file;
+    int retval;
+
+    KASSERT(curproc != NULL);
+
+    file = proc_get_file(curproc, fd);
+    if (!file)
+        return EBADF;
+
+    retval = iov_copyin(iov, iovcnt, fast_iov, &kiov);
+    if (retval)
+        goto out;
+
+    retval = file_writev(file, kiov, iovcnt, size_wrote);
+
+    iov_free(kiov, fast_iov);
+out:
+    file_put(file);
+    return retval;
+}
+
+int sys_pread(int fd, userptr_t buf, size_t nbyte, off_t offset, size_t *size_read)
+{
+    struct file *file;
+    int retval;
+
+    KASSERT(curproc != NULL);
+
+    file = proc_get_file(curproc, fd);
+    if (!file)
+        return EBADF;
+
+    retval = file_pread(file, buf, nbyte, offset, size_read);
+
+    file_put(file);
+    return retval;
+}
+
+int sys_pwrite(int fd, const_userptr_t buf, size_t nbyte, off_t offset, size_t *size_wrote)
+{
+    struct file *file;
+    int retval;
+
+    KASSERT(curproc != NULL);
+
+    file = proc_get_file(curproc, fd);
+    if (!file)
+        return EBADF;
+
+    retval = file_pwrite(file, buf, nbyte, offset, size_wrote);
+
+    file_put(file);
+    return retval;
+}
+#endif // OPT_SYSFS
+
 int sys_lseek(int fd, off_t offset, int whence, off_t *offset_location)
 {
     struct file *file;
@@ -132,10 +241,9 @@ int sys_lseek(int fd, off_t offset, int whence, off_t *offset_location)
         return EBADF;
 
     retval = file_lseek(file, offset, whence, offset_location);
-    if (retval)
-        return retval;
 
-    return 0;
+    file_put(file);
+    return retval;
 }
 
 #if OPT_SYSFS
@@ -157,7 +265,7 @@ int sys_open(const_userptr_t pathname, int flags, mode_t mode, int *fd)
 
     retval = copyinstr(pathname, kpathname, sizeof(kpathname), NULL);
     if (retval)
-        return retval;
+        goto bad_open_cleanup;
 
     retval = vfs_open(kpathname, flags, mode, &vnode);
     if (retval)
@@ -166,12 +274,17 @@ int sys_open(const_userptr_t pathname, int flags, mode_t mode, int *fd)
     /* add vnode to the new_file */
     new_file->vnode = vnode;
 
-    *fd = proc_add_new_file(curr, new_file);
+    retval = proc_add_new_file(curr, new_file, fd);
+    if (retval) {
+        /* also closes the vnode */
+        file_destroy(new_file);
+        return retval;
+    }
     
     return 0;
 
 bad_open_cleanup:
-    kfree(new_file);
+    file_free(new_file);
     return retval;
 }
 
@@ -211,6 +324,7 @@ int sys_fstat(int fd, userptr_t statbuf)
         return EBADF;
 
     retval = VOP_STAT(file->vnode, &stat);
+    file_put(file);
     if (retval)
         return retval;
 
@@ -8,6 +8,7 @@
 #include <current.h>
 #include <spl.h>
 #include <machine/trapframe.h>
+#include <slab.h>
 
 
 
@@ -28,7 +29,7 @@ int sys_fork(pid_t *pid, struct trapframe *tf)
     if (!new)
         return ENOMEM;
 
-    tf_copy = kmalloc(sizeof(struct trapframe));
+    tf_copy = kmem_cache_alloc(&trapframe_cache);
     if (!tf_copy)
         goto fork_out;
 
@@ -47,7 +48,7 @@ int sys_fork(pid_t *pid, struct trapframe *tf)
     return 0;
 
 bad_fork_cleanup_tf:
-    kfree(tf_copy);
+    kmem_cache_free(&trapframe_cache, tf_copy);
 fork_out:
     proc_destroy(new);
     return ENOMEM;
@@ -18,6 +18,16 @@ static bool check_options(int options)
 void sys__exit(int status)
 {
     struct proc *proc = curproc;
+    struct addrspace *as;
+
+    /*
+     * Only one thread tears the process down, the
+     * others leave as soon as they see `p_exiting`.
+     */
+    if (!proc_stop_threads(proc, true)) {
+        proc_uthread_exit(proc, status);
+        thread_stop();
+    }
     
     // TODO: when this proc exits and has children
     // attach them to the init process, that will
@@ -27,10 +37,22 @@ void sys__exit(int status)
     /*
      * Remove running thread from
      * process, this allows us to call
-     * signal on the wait_sem for the current
+     * wake up the parent waiting on the current
      * process, this would have not been
      * possible if thread_exit() was called
      */
+
+    /*
+     * Give back the memory and the swap entries
+     * now, the parent may wait for a long time
+     * before calling waitpid().
+     */
+    as = proc_setas(NULL);
+    if (as) {
+        as_deactivate();
+        as_destroy(as);
+    }
+
 	proc_remthread(curthread);
 
     proc_make_zombie(status, proc);
@@ -46,6 +68,7 @@ int sys_waitpid(pid_t pid, userptr_t wstatus, int options, pid_t *exit_pid)
     pid_t ret_pid;
     int sys_wstatus;
     struct proc *curr = curproc;
+    struct proc *child;
 
     KASSERT(exit_pid != NULL);
 
@@ -55,11 +78,13 @@ int sys_waitpid(pid_t pid, userptr_t wstatus, int options, pid_t *exit_pid)
     if (!check_options(options))
         return EINVAL;
 
-	struct proc *child = proc_get_child(pid, curr);
-	if (!child)
-		return ESRCH;
+    retval = proc_get_child(pid, curr, &child);
+    if (retval)
+        return retval;
 
     ret_pid = proc_check_zombie(child, &sys_wstatus, options, curr);
+    if (ret_pid < 0)
+        return EINTR;
     // TODO: cambiare
     *exit_pid = ret_pid;
 
@@ -0,0 +1,161 @@
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <syscall.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <thread.h>
+#include <types.h>
+#include <lib.h>
+#include <current.h>
+#include <copyinout.h>
+#include <signal.h>
+#include <machine/trapframe.h>
+#include <slab.h>
+#include <rwonce.h>
+#include "opt-paging.h"
+
+
+static void prepare_new_thread(struct trapframe *tf, unsigned long data)
+{
+    curthread->t_uthread = (struct uthread *)data;
+
+    /* the process started exiting before the thread could run */
+    if (READ_ONCE(curproc->p_exiting)) {
+        kmem_cache_free(&trapframe_cache, tf);
+        sys__exit(_MKWAIT_SIG(SIGKILL));
+    }
+
+    enter_new_thread(tf);
+}
+
+/**
+ * @brief Adds a new thread to the current process, it shares the
+ * address space and the file table and runs on a stack of its own.
+ * The thread starts at `entry` with `arg` as the only argument,
+ * `entry` must not return, it ends with thread_exit().
+ *
+ * @param entry user function the thread starts from
+ * @param arg argument of `entry`
+ * @param tf trapframe of the caller
+ * @param tid id of the new thread
+ * @return int error if any
+ */
+int sys_thread_create(userptr_t entry, userptr_t arg, struct trapframe *tf, int *tid)
+{
+#if OPT_PAGING
+    struct proc *proc = curproc;
+    struct trapframe *tf_copy;
+    struct uthread *ut;
+    vaddr_t stackptr;
+    int retval;
+
+    if (entry == NULL)
+        return EFAULT;
+
+    retval = proc_uthread_create(proc, &ut);
+    if (retval)
+        return retval;
+
+    retval = as_define_thread_stack(proc_getas(), &stackptr);
+    if (retval)
+        goto bad_create_cleanup_uthread;
+
+    ut->ut_stack = stackptr;
+
+    tf_copy = kmem_cache_alloc(&trapframe_cache);
+    if (!tf_copy) {
+        retval = ENOMEM;
+        goto bad_create_cleanup_stack;
+    }
+
+    /* keep the global pointer and the status of the caller */
+    memmove(tf_copy, tf, sizeof(struct trapframe));
+    tf_copy->tf_epc = (vaddr_t)entry;
+    /* PIC code expects the address of the function in t9 */
+    tf_copy->tf_t9 = (vaddr_t)entry;
+    tf_copy->tf_a0 = (vaddr_t)arg;
+    tf_copy->tf_sp = stackptr;
+    tf_copy->tf_ra = 0;
+
+    /* the record can be joined and freed as soon as the thread runs */
+    *tid = ut->ut_tid;
+
+    retval = thread_fork("user thread",
+        proc,
+        (void (*)(void *, unsigned long))prepare_new_thread,
+        (void *)tf_copy,
+        (unsigned long)ut);
+    if (retval)
+        goto bad_create_cleanup_tf;
+
+    return 0;
+
+bad_create_cleanup_tf:
+    kmem_cache_free(&trapframe_cache, tf_copy);
+bad_create_cleanup_stack:
+    as_release_thread_stack(proc_getas(), stackptr);
+bad_create_cleanup_uthread:
+    proc_uthread_destroy(proc, ut);
+    return retval;
+#else // OPT_PAGING
+    /* the stacks of the threads need the paging address space */
+    (void)entry;
+    (void)arg;
+    (void)tf;
+    (void)tid;
+
+    return ENOSYS;
+#endif // OPT_PAGING
+}
+
+/**
+ * @brief Terminates the current thread, `status` is handed
+ * to the thread joining it. When the last thread of the
+ * process exits, the process exits with status 0.
+ *
+ * @param status exit status of the thread
+ */
+void sys_thread_exit(int status)
+{
+    struct proc *proc = curproc;
+    struct uthread *ut = curthread->t_uthread;
+
+#if OPT_PAGING
+    /* the main thread runs on the stack of the process */
+    if (ut)
+        as_release_thread_stack(proc_getas(), ut->ut_stack);
+#else // OPT_PAGING
+    /* without paging no thread is created, only the main one exits */
+    KASSERT(ut == NULL);
+#endif // OPT_PAGING
+
+    if (!proc_uthread_exit(proc, status))
+        sys__exit(_MKWAIT_EXIT(0));
+
+    thread_stop();
+
+    panic("returned from thread_stop");
+}
+
+/**
+ * @brief Waits for the thread `tid` of the current
+ * process to exit.
+ *
+ * @param tid thread to wait for
+ * @param status if not NULL, set to the exit status of the thread
+ * @return int error if any
+ */
+int sys_thread_join(int tid, userptr_t status)
+{
+    int thread_status;
+    int retval;
+
+    retval = proc_uthread_join(curproc, tid, &thread_status);
+    if (retval)
+        return retval;
+
+    if (status != NULL)
+        retval = copyout(&thread_status, status, sizeof(int));
+
+    return retval;
+}
@@ -0,0 +1,290 @@
+/*
+ * Benchmark of the read/write data path: the old bounce
+ * buffer path (kmalloc, copy, VOP, kfree) against the
+ * direct one, file_read() and file_write() on a user buffer,
+ * where the data is moved once between the vnode and the
+ * user pages.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/time.h>
+#include <kern/wait.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <current.h>
+#include <proc.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <file.h>
+#include <syscall.h>
+#include <test.h>
+#include "opt-syscalls.h"
+
+/*
+ * Bytes moved by every run, whatever the request size.
+ */
+#define IOBENCH_TOTAL   (4 * 1024 * 1024)
+#define IOBENCH_MAXSIZE (1024 * 1024)
+
+/*
+ * User address of the buffer of the benchmark process.
+ */
+#define IOBENCH_UBUF    ((vaddr_t)0x10000000)
+
+static const size_t iobench_sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+/*
+ * Moves IOBENCH_TOTAL bytes between the file and the user
+ * buffer, `size` bytes per request. With `bounce` every
+ * request allocates a staging buffer and copies through
+ * it, like sys_read and sys_write used to do, otherwise
+ * it goes through file_read and file_write.
+ */
+static int
+iobench_run(struct file *file, userptr_t ubuf, size_t size, enum uio_rw rw,
+	    bool bounce, uint64_t *nsecs)
+{
+	struct timespec before, after, duration;
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	size_t moved;
+	char *kbuf;
+	int result = 0;
+
+	result = file_lseek(file, 0, SEEK_SET, &pos);
+	if (result) {
+		return result;
+	}
+
+	gettime(&before);
+	for (pos = 0; pos < IOBENCH_TOTAL; pos += size) {
+		if (!bounce) {
+			result = rw == UIO_READ ?
+				file_read(file, ubuf, size, &moved) :
+				file_write(file, ubuf, size, &moved);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		kbuf = kmalloc(size);
+		if (!kbuf) {
+			return ENOMEM;
+		}
+		if (rw == UIO_WRITE) {
+			result = copyin(ubuf, kbuf, size);
+		}
+
+		if (!result) {
+			uio_kinit(&iov, &ku, kbuf, size, pos, rw);
+			result = rw == UIO_READ ?
+				VOP_READ(file->vnode, &ku) :
+				VOP_WRITE(file->vnode, &ku);
+		}
+
+		if (!result && rw == UIO_READ) {
+			result = copyout(kbuf, ubuf, size);
+		}
+		kfree(kbuf);
+		if (result) {
+			return result;
+		}
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	*nsecs = (uint64_t)duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	if (*nsecs == 0)
+		*nsecs = 1;
+
+	return 0;
+}
+
+static int
+iobench_report(struct file *file, userptr_t ubuf, size_t size, enum uio_rw rw)
+{
+	uint64_t bounce_ns, direct_ns;
+	int result;
+
+	result = iobench_run(file, ubuf, size, rw, true, &bounce_ns);
+	if (result) {
+		return result;
+	}
+	result = iobench_run(file, ubuf, size, rw, false, &direct_ns);
+	if (result) {
+		return result;
+	}
+
+	kprintf("%-6s %8u KB %8llu MB/s %8llu MB/s\n",
+		rw == UIO_READ ? "read" : "write",
+		size / 1024,
+		(unsigned long long)((uint64_t)IOBENCH_TOTAL * 1000 / bounce_ns),
+		(unsigned long long)((uint64_t)IOBENCH_TOTAL * 1000 / direct_ns));
+
+	return 0;
+}
+
+/*
+ * Gives the benchmark process an address space with a
+ * IOBENCH_MAXSIZE buffer at IOBENCH_UBUF, filled with a
+ * pattern.
+ */
+static int
+iobench_setup_as(void)
+{
+	struct addrspace *as;
+	char *pattern;
+	vaddr_t addr;
+	int result;
+
+	as = as_create();
+	if (!as) {
+		return ENOMEM;
+	}
+	proc_setas(as);
+	as_activate();
+
+	result = as_define_region(as, IOBENCH_UBUF, IOBENCH_MAXSIZE,
+#if OPT_PAGING
+				  0, 0,
+#endif
+				  1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	result = as_prepare_load(as);
+	if (result) {
+		return result;
+	}
+
+	result = as_complete_load(as);
+	if (result) {
+		return result;
+	}
+
+	pattern = kmalloc(PAGE_SIZE);
+	if (!pattern) {
+		return ENOMEM;
+	}
+	memset(pattern, 0xa5, PAGE_SIZE);
+
+	for (addr = IOBENCH_UBUF; addr < IOBENCH_UBUF + IOBENCH_MAXSIZE; addr += PAGE_SIZE) {
+		result = copyout(pattern, (userptr_t)addr, PAGE_SIZE);
+		if (result)
+			break;
+	}
+
+	kfree(pattern);
+	return result;
+}
+
+/*
+ * Body of the benchmark process, the user buffer
+ * is only reachable from a thread running in it.
+ */
+static
+void
+iobench_thread(void *ptr, unsigned long nargs)
+{
+	char **args = ptr;
+	char path[] = "iobench.dat";
+	struct vnode *vn;
+	struct file *file;
+	unsigned i;
+	int result;
+
+	result = iobench_setup_as();
+	if (result) {
+		kprintf("iobench: address space: %s\n", strerror(result));
+		goto out;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	result = vfs_open(nargs > 1 ? args[1] : path, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result) {
+		kprintf("iobench: open: %s\n", strerror(result));
+		goto out;
+	}
+
+	file = file_create();
+	if (!file) {
+		vfs_close(vn);
+		result = ENOMEM;
+		goto out;
+	}
+	file->vnode = vn;
+
+	kprintf("Read/write path benchmark, %u KB per run\n", IOBENCH_TOTAL / 1024);
+	kprintf("%-6s %11s %13s %13s\n", "op", "request", "bounce", "direct");
+
+	for (i = 0; i < ARRAYCOUNT(iobench_sizes); i++) {
+		result = iobench_report(file, (userptr_t)IOBENCH_UBUF, iobench_sizes[i], UIO_WRITE);
+		if (result)
+			break;
+
+		result = iobench_report(file, (userptr_t)IOBENCH_UBUF, iobench_sizes[i], UIO_READ);
+		if (result)
+			break;
+	}
+	if (result) {
+		kprintf("iobench: %s\n", strerror(result));
+	}
+
+	/* closes the vnode too */
+	file_destroy(file);
+out:
+#if OPT_SYSCALLS
+	sys__exit(_MKWAIT_EXIT(result));
+#endif
+	return;
+}
+
+/*
+ * Writes and reads back IOBENCH_TOTAL bytes of a file with
+ * 4 KB, 64 KB and 1 MB requests, on both paths. It runs in
+ * a process of its own, so the direct path copies from and
+ * to a real user buffer.
+ */
+int
+iobench(int nargs, char **args)
+{
+	struct proc *proc;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: iob [file]\n");
+		return EINVAL;
+	}
+
+	proc = proc_create_runprogram("iobench");
+	if (proc == NULL) {
+		return ENOMEM;
+	}
+
+	result = thread_fork("iobench", proc, iobench_thread, args, nargs);
+	if (result) {
+		kprintf("iobench: thread_fork: %s\n", strerror(result));
+		proc_destroy(proc);
+		return result;
+	}
+
+#if OPT_SYSCALLS
+	int exit_code = 0;
+	if (proc->pid != -1) {
+		if (proc_check_zombie(proc, &exit_code, 0, curproc) == 0)
+			panic("iobench: waiting for the benchmark failed\n");
+		result = WEXITSTATUS(exit_code);
+	}
+#endif // OPT_SYSCALLS
+
+	return result;
+}
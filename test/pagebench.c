@@ -0,0 +1,197 @@
+/*
+ * Benchmark of the page copy and zero routines
+ * against the generic memcpy and memset, and of
+ * the page table backend.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <pt.h>
+#include <test.h>
+
+#define PAGEBENCH_ITERATIONS 2000
+
+/*
+ * Pages mapped by ptbench, one every PTBENCH_STRIDE
+ * bytes to mimic a sparse address space.
+ */
+#define PTBENCH_PAGES   64
+#define PTBENCH_STRIDE  (64 * PAGE_SIZE)
+#define PTBENCH_BASE    0x400000
+
+typedef void (*pagebench_fn)(void *dst, void *src);
+
+static void bench_memcpy(void *dst, void *src)
+{
+	memcpy(dst, src, PAGE_SIZE);
+}
+
+static void bench_kpage_copy(void *dst, void *src)
+{
+	kpage_copy(dst, src);
+}
+
+static void bench_memset(void *dst, void *src)
+{
+	(void)src;
+	memset(dst, 0, PAGE_SIZE);
+}
+
+static void bench_kpage_zero(void *dst, void *src)
+{
+	(void)src;
+	kpage_zero(dst);
+}
+
+static void
+pagebench_run(const char *name, pagebench_fn fn, void *dst, void *src, unsigned iterations)
+{
+	struct timespec before, after, duration;
+	uint64_t nsecs;
+	unsigned i;
+
+	gettime(&before);
+	for (i = 0; i < iterations; i++) {
+		fn(dst, src);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	nsecs = (uint64_t)duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	if (nsecs == 0)
+		nsecs = 1;
+
+	kprintf("%-12s %10llu ns %8llu ns/page %8llu MB/s\n",
+		name,
+		(unsigned long long)nsecs,
+		(unsigned long long)(nsecs / iterations),
+		(unsigned long long)((uint64_t)iterations * PAGE_SIZE * 1000 / nsecs));
+}
+
+/*
+ * Times `iterations` page copies and zeroes, with the generic
+ * routines and with the page granular ones. The pages are
+ * touched once before, so every run starts with the same
+ * cache state.
+ */
+int
+pagebench(int nargs, char **args)
+{
+	unsigned iterations = PAGEBENCH_ITERATIONS;
+	vaddr_t src, dst;
+
+	if (nargs > 1) {
+		iterations = atoi(args[1]);
+	}
+	if (iterations == 0) {
+		kprintf("Usage: pb [iterations]\n");
+		return EINVAL;
+	}
+
+	src = alloc_kpages(1);
+	dst = alloc_kpages(1);
+	if (!src || !dst) {
+		kprintf("pagebench: out of memory\n");
+		if (src)
+			free_kpages(src);
+		if (dst)
+			free_kpages(dst);
+		return ENOMEM;
+	}
+
+	memset((void *)src, 0xa5, PAGE_SIZE);
+	memset((void *)dst, 0, PAGE_SIZE);
+
+	kprintf("Page copy/zero benchmark, %u iterations\n", iterations);
+	pagebench_run("memcpy", bench_memcpy, (void *)dst, (void *)src, iterations);
+	pagebench_run("kpage_copy", bench_kpage_copy, (void *)dst, (void *)src, iterations);
+	pagebench_run("memset", bench_memset, (void *)dst, (void *)src, iterations);
+	pagebench_run("kpage_zero", bench_kpage_zero, (void *)dst, (void *)src, iterations);
+
+	free_kpages(dst);
+	free_kpages(src);
+
+	return 0;
+}
+
+static uint64_t
+ptbench_elapsed(const struct timespec *before)
+{
+	struct timespec after, duration;
+
+	gettime(&after);
+	timespec_sub(&after, before, &duration);
+
+	return (uint64_t)duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+}
+
+/*
+ * Maps `npages` sparse pages in a private page table and
+ * reports the memory used by the table and the time spent
+ * in the allocation and in the lookup path of a fault.
+ * Run it on kernels built with and without `hashpt` to
+ * compare the two backends.
+ */
+int
+ptbench(int nargs, char **args)
+{
+	struct page_table pt;
+	struct pt_page_flags flags = { .page_rw = true, .page_pwt = false };
+	struct timespec before;
+	uint64_t alloc_ns, lookup_ns;
+	unsigned npages = PTBENCH_PAGES;
+	unsigned i;
+	paddr_t paddr;
+	pte_t *pte;
+	int result;
+
+	if (nargs > 1) {
+		npages = atoi(args[1]);
+	}
+	if (npages == 0) {
+		kprintf("Usage: ptb [pages]\n");
+		return EINVAL;
+	}
+
+	result = pt_init(&pt);
+	if (result) {
+		return result;
+	}
+
+	gettime(&before);
+	for (i = 0; i < npages; i++) {
+		result = pt_alloc_page(&pt, PTBENCH_BASE + i * PTBENCH_STRIDE, flags, &paddr);
+		if (result) {
+			kprintf("ptbench: out of memory after %u pages\n", i);
+			npages = i;
+			break;
+		}
+	}
+	alloc_ns = ptbench_elapsed(&before);
+
+	gettime(&before);
+	for (i = 0; i < npages; i++) {
+		pte = pt_get_or_alloc_pte(&pt, PTBENCH_BASE + i * PTBENCH_STRIDE);
+		KASSERT(pte != NULL && pte_present(*pte));
+	}
+	lookup_ns = ptbench_elapsed(&before);
+
+	kprintf("Page table benchmark, %u pages %u bytes apart\n",
+		npages, PTBENCH_STRIDE);
+	kprintf("table pages:\t%8u (%u bytes per mapped page)\n",
+		pt.table_pages,
+		npages ? pt.table_pages * PAGE_SIZE / npages : 0);
+	if (npages > 0) {
+		kprintf("alloc:\t\t%8llu ns/page\n",
+			(unsigned long long)(alloc_ns / npages));
+		kprintf("lookup:\t\t%8llu ns/page\n",
+			(unsigned long long)(lookup_ns / npages));
+	}
+
+	pt_destroy(&pt);
+
+	return result;
+}
@@ -34,6 +34,9 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <wss.h>
+#include <oom.h>
+#include "opt-paging.h"
 
 /*
  * Time handling.
@@ -83,6 +86,9 @@ timerclock(void)
 	spinlock_acquire(&lbolt_lock);
 	wchan_wakeall(lbolt, &lbolt_lock);
 	spinlock_release(&lbolt_lock);
+#if OPT_PAGING
+	oom_timerclock();
+#endif // OPT_PAGING
 }
 
 /*
@@ -97,6 +103,9 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+#if OPT_PAGING
+	wss_hardclock();
+#endif // OPT_PAGING
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
@@ -33,12 +33,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <slab.h>
+
+static DEFINE_KMEM_CACHE(lock_cache, struct lock, NULL);
 
 ////////////////////////////////////////////////////////////
 //
@@ -122,6 +126,39 @@ void P(struct semaphore *sem)
     spinlock_release(&sem->sem_lock);
 }
 
+int P_interruptible(struct semaphore *sem, bool (*interrupted)(void))
+{
+    KASSERT(sem != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&sem->sem_lock);
+    while (sem->sem_count == 0)
+    {
+        /* checked under sem_lock, sem_wakeall() can't be missed */
+        if (interrupted())
+        {
+            spinlock_release(&sem->sem_lock);
+            return EINTR;
+        }
+
+        wchan_sleep(sem->sem_wchan, &sem->sem_lock);
+    }
+    KASSERT(sem->sem_count > 0);
+    sem->sem_count--;
+    spinlock_release(&sem->sem_lock);
+
+    return 0;
+}
+
+void sem_wakeall(struct semaphore *sem)
+{
+    KASSERT(sem != NULL);
+
+    spinlock_acquire(&sem->sem_lock);
+    wchan_wakeall(sem->sem_wchan, &sem->sem_lock);
+    spinlock_release(&sem->sem_lock);
+}
+
 void V(struct semaphore *sem)
 {
     KASSERT(sem != NULL);
@@ -144,7 +181,7 @@ lock_create(const char *name)
 {
     struct lock *lock;
 
-    lock = kmalloc(sizeof(*lock));
+    lock = kmem_cache_alloc(&lock_cache);
     if (lock == NULL)
     {
         return NULL;
@@ -153,7 +190,7 @@ lock_create(const char *name)
     lock->lk_name = kstrdup(name);
     if (lock->lk_name == NULL)
     {
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
         return NULL;
     }
 
@@ -164,7 +201,7 @@ lock_create(const char *name)
     if (lock->lk_wchan == NULL)
     {
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
         return NULL;
     }
 
@@ -186,7 +223,7 @@ void lock_destroy(struct lock *lock)
     wchan_destroy(lock->lk_wchan);
 #endif // OPT_LOCK
     kfree(lock->lk_name);
-    kfree(lock);
+    kmem_cache_free(&lock_cache, lock);
 }
 
 void lock_acquire(struct lock *lock)
@@ -226,6 +263,40 @@ void lock_acquire(struct lock *lock)
 #endif // OPT_LOCK
 }
 
+bool lock_tryacquire(struct lock *lock)
+{
+    bool acquired = false;
+
+    KASSERT(lock != NULL);
+
+#if OPT_LOCK
+    spinlock_acquire(&lock->lk_lock);
+
+    if (lock->locked == false)
+    {
+        if (CURCPU_EXISTS()) {
+            HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+        }
+
+        lock->locked = true;
+        KASSERT(lock->lk_owner == NULL);
+        lock->lk_owner = curthread;
+        acquired = true;
+
+        if (CURCPU_EXISTS()) {
+            HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+        }
+    }
+
+    spinlock_release(&lock->lk_lock);
+#else
+    (void)lock;
+    acquired = true;
+#endif // OPT_LOCK
+
+    return acquired;
+}
+
 void lock_release(struct lock *lock)
 {
     KASSERT(lock != NULL);
@@ -50,16 +50,14 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <slab.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
-/* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
-struct wchan {
-	const char *wc_name;		/* name for this channel */
-	struct threadlist wc_threads;	/* list of waiting threads */
-};
+/* Cache of the wait channels */
+static DEFINE_KMEM_CACHE(wchan_cache, struct wchan, NULL);
 
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
@@ -148,6 +146,7 @@ thread_create(const char *name)
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
 	/* If you add to struct thread, be sure to initialize here */
+	thread->t_uthread = NULL;
 
 	return thread;
 }
@@ -996,12 +995,11 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
-	wc->wc_name = name;
+	wchan_init(wc, name);
 
 	return wc;
 }
@@ -1012,9 +1010,29 @@ wchan_create(const char *name)
  */
 void
 wchan_destroy(struct wchan *wc)
+{
+	wchan_cleanup(wc);
+	kmem_cache_free(&wchan_cache, wc);
+}
+
+/*
+ * Initialize a wait channel that lives inside another
+ * structure, no allocation is needed.
+ */
+void
+wchan_init(struct wchan *wc, const char *name)
+{
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = name;
+}
+
+/*
+ * Clean up an embedded wait channel. Must be empty and unlocked.
+ */
+void
+wchan_cleanup(struct wchan *wc)
 {
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
 }
 
 /*
@@ -1188,6 +1206,28 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs except the current one.
+ * Returns the number of CPUs the shootdown was sent to.
+ */
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	unsigned sent = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			sent++;
+		}
+	}
+
+	return sent;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
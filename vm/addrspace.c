@@ -39,6 +39,40 @@
 #include <copyinout.h>
 #include <machine/tlb.h>
 #include <vm_tlb.h>
+#include <synch.h>
+#include <slab.h>
+#include <rwonce.h>
+#include <oom.h>
+
+/*
+ * List of all the address spaces in the system,
+ * used to reach the page tables of every process.
+ */
+static LIST_HEAD(as_list);
+static struct lock *as_list_lock;
+static unsigned nr_as = 0;
+static unsigned next_as_id = 1;
+
+/*
+ * Page faults per sampling period above which an address
+ * space is considered thrashing, the reclaim weight of its
+ * pages is divided by AS_PFF_HIGH_DIV.
+ */
+#define AS_PFF_HIGH     (16)
+#define AS_PFF_HIGH_DIV (4)
+
+/*
+ * The areas in the cache are always kept
+ * unlinked, as_destroy_area() checks it.
+ */
+static void as_area_ctor(void *obj)
+{
+	struct addrspace_area *area = obj;
+
+	INIT_LIST_HEAD(&area->next_area);
+}
+
+static DEFINE_KMEM_CACHE(area_cache, struct addrspace_area, as_area_ctor);
 
 static struct addrspace_area *
 as_create_area(vaddr_t start,
@@ -53,7 +87,7 @@ as_create_area(vaddr_t start,
 	KASSERT(start < end);
 	KASSERT((type == ASA_TYPE_FILE) ? true : ((seg_size == 0) && (seg_offset == 0)));
 
-	area = kmalloc(sizeof(struct addrspace_area));
+	area = kmem_cache_alloc(&area_cache);
 	if (!area)
 		return NULL;
 
@@ -64,7 +98,7 @@ as_create_area(vaddr_t start,
 	area->area_flags = flags;
 	area->area_type = type;
 
-	INIT_LIST_HEAD(&area->next_area);
+	KASSERT(list_empty(&area->next_area));
 
 	return area;
 }
@@ -74,7 +108,7 @@ as_destroy_area(struct addrspace_area *as_area)
 {
 	KASSERT(list_empty(&as_area->next_area));
 
-	kfree(as_area);
+	kmem_cache_free(&area_cache, as_area);
 }
 
 static int
@@ -107,7 +141,7 @@ as_copy_area(struct addrspace *new, struct addrspace *old)
 		/* set AS_AREA_MAY_WRITE for COW mapping */
 		old_area->area_flags |= asa_write(old_area) * AS_AREA_MAY_WRITE;
 
-		new_area = kmalloc(sizeof(struct addrspace_area));
+		new_area = kmem_cache_alloc(&area_cache);
 		if (!new_area)
 			return ENOMEM;
 
@@ -132,6 +166,14 @@ as_copy_area(struct addrspace *new, struct addrspace *old)
 /* temp variable */
 #define AS_STACKPAGES 16
 
+/*
+ * The stacks of the threads created by thread_create() are
+ * placed below the main stack, an unmapped guard page
+ * separates each of them from the one above.
+ */
+#define AS_THREAD_STACKS_MAX	(32)
+#define AS_THREAD_STACK_STRIDE	((AS_STACKPAGES + 1) * PAGE_SIZE)
+
 /**
  * @brief Create a new empty address space. You need to make
  * sure this gets called in all the right places. You
@@ -156,9 +198,13 @@ as_create(void)
 	if (!as->as_file_lock)
 		goto out;
 
+	as->pt_lock = lock_create("pt_lock");
+	if (!as->pt_lock)
+		goto bad_lock_cleanup;
+
 	retval = pt_init(&as->pt);
 	if (retval)
-		goto bad_lock_cleanup;
+		goto bad_pt_lock_cleanup;
 
 	INIT_LIST_HEAD(&as->addrspace_area_list);
 
@@ -167,13 +213,30 @@ as_create(void)
 	/* initialize stack region */
 	as->start_stack = 0;
 	as->end_stack = 0;
+	as->thread_stacks = 0;
+	as->thread_stacks_mapped = 0;
 
 	/* initialize args region */
 	as->start_arg = 0;
 	as->end_arg = 0;
 
+	as->rss_limit = 0;
+	as->wss_pages = 0;
+	as->nr_faults = 0;
+	as->pff = 0;
+
+	lock_acquire(as_list_lock);
+	/* the list stays sorted by id, as_walk_resume() relies on it */
+	as->as_id = next_as_id++;
+	list_add_tail(&as->as_list, &as_list);
+	nr_as += 1;
+	lock_release(as_list_lock);
+
 	return as;
 
+bad_pt_lock_cleanup:
+	lock_destroy(as->pt_lock);
+
 bad_lock_cleanup:
 	lock_destroy(as->as_file_lock);
 
@@ -204,21 +267,39 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 
 	new->start_arg = old->start_arg;
 	new->end_arg = old->end_arg;
+	new->rss_limit = old->rss_limit;
+	new->wss_pages = old->wss_pages;
 	new->start_stack = old->start_stack;
 	new->end_stack = old->end_stack;
 
 	VOP_INCREF(old->source_file);
 	new->source_file = old->source_file;
 
+	/* the areas can change under the other threads of the process */
+	lock_acquire(old->pt_lock);
+	lock_acquire(new->pt_lock);
+
+	/*
+	 * The child can be running on the stack of any thread,
+	 * all the slots in use are kept.
+	 */
+	new->thread_stacks = old->thread_stacks;
+	new->thread_stacks_mapped = old->thread_stacks_mapped;
+
 	retval = as_copy_area(new, old);
-	if (retval)
-		goto bad_as_copy_area_cleanup;
+	if (!retval)
+		retval = pt_copy(&new->pt, &old->pt);
+
+	/*
+	 * The pages are COW now, the other threads of
+	 * the process must not write through the old entries.
+	 */
+	vm_tlb_invalidate(0);
 
-	retval = pt_copy(&new->pt, &old->pt);
+	lock_release(new->pt_lock);
+	lock_release(old->pt_lock);
 	if (retval)
 		goto bad_as_copy_area_cleanup;
-
-	vm_tlb_flush();
 	
 	*ret = new;
 	return 0;
@@ -238,6 +319,11 @@ as_destroy(struct addrspace *as)
 {
 	struct addrspace_area *area, *temp;
 
+	lock_acquire(as_list_lock);
+	list_del_init(&as->as_list);
+	nr_as -= 1;
+	lock_release(as_list_lock);
+
 	as_for_each_area_safe(as, area, temp) {
 		list_del_init(&area->next_area);
 		as_destroy_area(area);
@@ -247,11 +333,17 @@ as_destroy(struct addrspace *as)
 
 	pt_destroy(&as->pt);
 
+	lock_destroy(as->pt_lock);
 	lock_destroy(as->as_file_lock);
 
-	vfs_close(as->source_file);
+	/* not set for an address space built by the kernel */
+	if (as->source_file)
+		vfs_close(as->source_file);
 
 	kfree(as);
+
+	/* the memory of a victim of the OOM killer is free now */
+	oom_wakeup();
 }
 
 void
@@ -277,6 +369,341 @@ as_deactivate(void)
 	 */
 }
 
+/**
+ * @brief Initialize the list of address spaces,
+ * called from vm_bootstrap.
+ * 
+ */
+void
+as_bootstrap(void)
+{
+	as_list_lock = lock_create("as_list_lock");
+	if (!as_list_lock)
+		panic("as_bootstrap: could not create as_list_lock\n");
+}
+
+/**
+ * @brief Walk the page table of every address space in the
+ * system. This never sleeps waiting for a lock: the
+ * address spaces whose page table is locked by another
+ * thread are skipped, the one held by the caller is walked
+ * without locking it again.
+ * 
+ * @param start starting virtual address
+ * @param end ending virtual address (not included)
+ * @param f function called on each pte
+ * @param private data passed to `f`
+ * @return int EBUSY if the list of address spaces is locked
+ */
+int
+as_walk_all(vaddr_t start, vaddr_t end, walk_ops_t f, void *private)
+{
+	struct addrspace *as;
+	bool held;
+
+	if (!lock_tryacquire(as_list_lock))
+		return EBUSY;
+
+	list_for_each_entry(as, &as_list, as_list) {
+		held = lock_do_i_hold(as->pt_lock);
+		if (!held && !lock_tryacquire(as->pt_lock))
+			continue;
+
+		pt_walk_page_table(&as->pt, start, end, f, private);
+
+		if (!held)
+			lock_release(as->pt_lock);
+	}
+
+	lock_release(as_list_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Like `as_walk_all` but the walk can be stopped and
+ * resumed later, without holding any lock in between. `f`
+ * stops it by setting `cursor->stopped` and moving the cursor
+ * to where the next call has to start from.
+ * 
+ * @param cursor where to start from, zeroed for a new walk
+ * @param f function called on each pte
+ * @param private data passed to `f`
+ * @return int EBUSY if the list of address spaces is locked
+ */
+int
+as_walk_resume(struct as_cursor *cursor, walk_ops_t f, void *private)
+{
+	struct addrspace *as;
+	vaddr_t start;
+	bool held;
+
+	if (!lock_tryacquire(as_list_lock))
+		return EBUSY;
+
+	cursor->stopped = false;
+
+	list_for_each_entry(as, &as_list, as_list) {
+		/* walked before the walk was stopped */
+		if (as->as_id < cursor->as_id)
+			continue;
+
+		start = as->as_id == cursor->as_id ? cursor->addr : 0;
+		if (start >= USERSPACETOP)
+			continue;
+
+		held = lock_do_i_hold(as->pt_lock);
+		if (!held && !lock_tryacquire(as->pt_lock))
+			continue;
+
+		pt_walk_page_table(&as->pt, start, USERSPACETOP, f, private);
+
+		if (!held)
+			lock_release(as->pt_lock);
+
+		if (cursor->stopped)
+			break;
+	}
+
+	lock_release(as_list_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Walk the page table of the address space with id
+ * `as_id`, to be called from the function passed to
+ * `as_walk_all` or `as_walk_resume`, which hold the list of
+ * address spaces locked.
+ * 
+ * @param as_id id of the address space
+ * @param start starting virtual address
+ * @param end ending virtual address (not included)
+ * @param f function called on each pte
+ * @param private data passed to `f`
+ * @return int ESRCH if the address space does not exist anymore,
+ * EBUSY if its page table is locked
+ */
+int
+as_walk_one(unsigned as_id, vaddr_t start, vaddr_t end, walk_ops_t f, void *private)
+{
+	struct addrspace *as;
+	bool held;
+
+	KASSERT(lock_do_i_hold(as_list_lock));
+
+	list_for_each_entry(as, &as_list, as_list) {
+		if (as->as_id != as_id)
+			continue;
+
+		held = lock_do_i_hold(as->pt_lock);
+		if (!held && !lock_tryacquire(as->pt_lock))
+			return EBUSY;
+
+		pt_walk_page_table(&as->pt, start, end, f, private);
+
+		if (!held)
+			lock_release(as->pt_lock);
+
+		return 0;
+	}
+
+	return ESRCH;
+}
+
+/**
+ * @brief Calls `f` on each address space holding its page
+ * table lock. Like `as_walk_all` it never sleeps waiting for
+ * a lock, the busy address spaces are skipped.
+ * 
+ * @param f function called on each address space
+ * @param private data passed to `f`
+ * @return int EBUSY if the list of address spaces is locked
+ */
+int
+as_for_each(void (*f)(struct addrspace *as, void *private), void *private)
+{
+	struct addrspace *as;
+	bool held;
+
+	if (!lock_tryacquire(as_list_lock))
+		return EBUSY;
+
+	list_for_each_entry(as, &as_list, as_list) {
+		held = lock_do_i_hold(as->pt_lock);
+		if (!held && !lock_tryacquire(as->pt_lock))
+			continue;
+
+		f(as, private);
+
+		if (!held)
+			lock_release(as->pt_lock);
+	}
+
+	lock_release(as_list_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Resident pages limit of an address space, if no
+ * limit was set it's a fair share of the memory among
+ * all the address spaces.
+ * 
+ * @param as address space
+ * @return size_t 
+ */
+size_t
+as_rss_limit(struct addrspace *as)
+{
+	unsigned n = READ_ONCE(nr_as);
+	size_t limit = READ_ONCE(as->rss_limit);
+
+	if (limit)
+		return limit;
+
+	return total_pages / (n ? n : 1);
+}
+
+/**
+ * @brief Sets the resident pages limit of the address space,
+ * once over it reclaim prefers its pages. A limit of 0 gives
+ * back the fair share.
+ *
+ * @param as address space
+ * @param pages new limit
+ */
+void
+as_set_rss_limit(struct addrspace *as, size_t pages)
+{
+	WRITE_ONCE(as->rss_limit, pages);
+}
+
+/**
+ * @brief Pages of the address space worth reclaiming: `pages`
+ * is scaled down when the address space is faulting often,
+ * taking more pages from it would only make it thrash.
+ * 
+ * @param as address space
+ * @param pages candidate pages
+ * @return size_t 
+ */
+static inline size_t
+as_reclaim_weight(struct addrspace *as, size_t pages)
+{
+	if (READ_ONCE(as->pff) >= AS_PFF_HIGH)
+		return pages / AS_PFF_HIGH_DIV;
+
+	return pages;
+}
+
+/**
+ * @brief Walk the page table of `victim`, the list of address
+ * spaces must be locked by the caller.
+ * 
+ * @return int EBUSY if the page table is locked by another thread
+ */
+static int
+as_walk_victim(struct addrspace *victim, walk_ops_t f, void *private)
+{
+	bool held;
+
+	held = lock_do_i_hold(victim->pt_lock);
+	if (!held && !lock_tryacquire(victim->pt_lock))
+		return EBUSY;
+
+	pt_walk_page_table(&victim->pt, 0, USERSPACETOP, f, private);
+
+	if (!held)
+		lock_release(victim->pt_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Walk the page table of the address space that
+ * exceeds its resident limit by the most pages. Like
+ * `as_walk_all` it never sleeps waiting for a lock.
+ * 
+ * @param f function called on each pte
+ * @param private data passed to `f`
+ * @return int ENOENT if no address space is over its limit,
+ * EBUSY if the list of address spaces is locked
+ */
+int
+as_walk_over_limit(walk_ops_t f, void *private)
+{
+	struct addrspace *as, *victim = NULL;
+	size_t rss, limit, weight, excess = 0;
+	int retval = ENOENT;
+
+	if (!lock_tryacquire(as_list_lock))
+		return EBUSY;
+
+	list_for_each_entry(as, &as_list, as_list) {
+		rss = READ_ONCE(as->pt.total_pages);
+		limit = as_rss_limit(as);
+
+		if (rss <= limit)
+			continue;
+
+		weight = as_reclaim_weight(as, rss - limit);
+		if (weight > excess) {
+			victim = as;
+			excess = weight;
+		}
+	}
+
+	if (victim)
+		retval = as_walk_victim(victim, f, private);
+
+	lock_release(as_list_lock);
+
+	return retval;
+}
+
+/**
+ * @brief Walk the page table of the address space with the
+ * most resident pages outside of its working set estimate.
+ * Like `as_walk_all` it never sleeps waiting for a lock.
+ * 
+ * @param f function called on each pte
+ * @param private data passed to `f`
+ * @return int ENOENT if every address space is within its
+ * working set, EBUSY if the list of address spaces is locked
+ */
+int
+as_walk_coldest(walk_ops_t f, void *private)
+{
+	struct addrspace *as, *victim = NULL;
+	size_t rss, wss, weight, cold = 0;
+	int retval = ENOENT;
+
+	if (!lock_tryacquire(as_list_lock))
+		return EBUSY;
+
+	list_for_each_entry(as, &as_list, as_list) {
+		rss = READ_ONCE(as->pt.total_pages);
+		wss = READ_ONCE(as->wss_pages);
+
+		if (rss <= wss)
+			continue;
+
+		weight = as_reclaim_weight(as, rss - wss);
+		if (weight > cold) {
+			victim = as;
+			cold = weight;
+		}
+	}
+
+	if (victim)
+		retval = as_walk_victim(victim, f, private);
+
+	lock_release(as_list_lock);
+
+	return retval;
+}
+
 /**
  * @brief Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -352,6 +779,8 @@ as_prepare_load(struct addrspace *as)
 	int retval;
 	struct addrspace_area *area;
 
+	lock_acquire(as->pt_lock);
+
 	as_for_each_area(as, area) {
 		retval = pt_alloc_page_range(&as->pt,
 				area->area_start,
@@ -362,10 +791,14 @@ as_prepare_load(struct addrspace *as)
 				});
 
 		if (retval)
-			return retval;
+			goto out;
 	}
 
-	return 0;
+	retval = 0;
+
+out:
+	lock_release(as->pt_lock);
+	return retval;
 }
 
 /**
@@ -417,10 +850,12 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 #endif // OPT_ARGS
 	as->start_stack = as->end_stack - AS_STACKPAGES * PAGE_SIZE;
 
+	lock_acquire(as->pt_lock);
 	retval = pt_alloc_page_range(&as->pt, as->start_stack, as->end_stack, (struct pt_page_flags){
 		.page_rw = true,
 		.page_pwt = false,
 	});
+	lock_release(as->pt_lock);
 	if (retval)
 		return retval;
 
@@ -437,6 +872,103 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+static inline vaddr_t as_thread_stack_top(struct addrspace *as, unsigned slot)
+{
+	return as->start_stack - PAGE_SIZE - slot * AS_THREAD_STACK_STRIDE;
+}
+
+/**
+ * @brief Set up the user stack of a new thread. A slot left
+ * by an exited thread is reused, otherwise an area is added
+ * for a new one. The pages are zero-filled on the first touch.
+ * 
+ * @param as address space of the process
+ * @param stackptr initial stack pointer of the thread
+ * @return int EAGAIN if there are too many threads, ENOMEM
+ */
+int
+as_define_thread_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	struct addrspace_area *area;
+	vaddr_t start, end;
+	unsigned slot;
+	int retval = 0;
+
+	KASSERT(as != NULL);
+	KASSERT(as->start_stack != 0);
+
+	lock_acquire(as->pt_lock);
+
+	if (as->thread_stacks == ~(uint32_t)0) {
+		retval = EAGAIN;
+		goto out;
+	}
+
+	slot = __builtin_ctz(~as->thread_stacks);
+	KASSERT(slot < AS_THREAD_STACKS_MAX);
+
+	end = as_thread_stack_top(as, slot);
+	start = end - AS_STACKPAGES * PAGE_SIZE;
+
+	if ((as->thread_stacks_mapped & (1U << slot)) == 0) {
+		area = as_create_area(start, end, 0, 0, AS_AREA_READ | AS_AREA_WRITE, ASA_TYPE_STACK);
+		if (!area) {
+			retval = ENOMEM;
+			goto out;
+		}
+
+		/* the stack would overlap the data of the program */
+		retval = as_add_area(as, area);
+		if (retval) {
+			as_destroy_area(area);
+			retval = ENOMEM;
+			goto out;
+		}
+
+		as->thread_stacks_mapped |= 1U << slot;
+	}
+
+	as->thread_stacks |= 1U << slot;
+	*stackptr = end;
+
+out:
+	lock_release(as->pt_lock);
+	return retval;
+}
+
+/**
+ * @brief Gives back the stack of an exited thread, its pages
+ * are unmapped so the next thread of the slot starts on
+ * zero-filled pages.
+ * 
+ * @param as address space of the process
+ * @param stackptr stack returned by as_define_thread_stack()
+ */
+void
+as_release_thread_stack(struct addrspace *as, vaddr_t stackptr)
+{
+	unsigned slot;
+	vaddr_t start;
+
+	KASSERT(as != NULL);
+	KASSERT(stackptr < as->start_stack);
+
+	slot = (as->start_stack - PAGE_SIZE - stackptr) / AS_THREAD_STACK_STRIDE;
+	KASSERT(slot < AS_THREAD_STACKS_MAX);
+	KASSERT(as_thread_stack_top(as, slot) == stackptr);
+
+	lock_acquire(as->pt_lock);
+	KASSERT(as->thread_stacks & (1U << slot));
+	as->thread_stacks &= ~(1U << slot);
+
+	/* the area stays, only the pages of the old thread go */
+	start = stackptr - AS_STACKPAGES * PAGE_SIZE;
+	pt_unmap_range(&as->pt, start, stackptr);
+	vm_tlb_invalidate(0);
+
+	lock_release(as->pt_lock);
+}
+
 /**
  * @brief Find an area in the address space associated
  * with the address `addr`.
@@ -449,6 +981,9 @@ struct addrspace_area *as_find_area(struct addrspace *as, vaddr_t addr)
 {
 	struct addrspace_area *area;
 
+	/* other threads can add areas */
+	KASSERT(lock_do_i_hold(as->pt_lock));
+
 	as_for_each_area(as, area) {
 		if (addr >= area->area_start && addr < area->area_end)
 			return area;
@@ -512,10 +1047,12 @@ int as_define_args(struct addrspace *as, int argc, char **argv, userptr_t *uargv
 		return retval;
 
 	/* allocate the page for the required space */
+	lock_acquire(as->pt_lock);
 	retval = pt_alloc_page_range(&as->pt, as->start_arg, as->end_arg, (struct pt_page_flags){
 		.page_rw = true,
 		.page_pwt = false,
 	});
+	lock_release(as->pt_lock);
 	if (retval)
 		return retval;
 
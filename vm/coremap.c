@@ -7,10 +7,15 @@
 #include <getorder.h>
 #include <cpu.h>
 #include <current.h>
+#include <thread.h>
 #include <proc.h>
 #include <page.h>
 #include <swap.h>
 #include <vm_tlb.h>
+#include <synch.h>
+#include <wchan.h>
+#include <slab.h>
+#include <oom.h>
 #include <kern/errno.h>
 
 /*
@@ -18,17 +23,52 @@
  */
 static struct spinlock mem_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Pages given back by free_pages_list() before
+ * releasing mem_lock, bounds the time spent with
+ * interrupts disabled.
+ */
+#define FREE_PAGES_BATCH (64)
+
 /*
  * List of system pages, each represent a physical page
  */
 struct page *page_table = NULL;
 size_t total_pages = 0;
 
+/*
+ * Pages whose struct page is initialized, the others
+ * are initialized in the background after the boot.
+ */
+size_t initialized_pages = 0;
+
+/*
+ * Pages initialized during the boot, enough to bring up
+ * the kernel. The deferred init thread adds DEFERRED_INIT_BATCH
+ * pages at a time, an allocation finding the free lists empty
+ * adds DEFERRED_INIT_ON_DEMAND. The init works on max order
+ * blocks, the values are rounded up to a whole block.
+ */
+#define EAGER_INIT_PAGES	(1024)
+#define DEFERRED_INIT_BATCH	(256)
+#define DEFERRED_INIT_ON_DEMAND	(1)
+
+#define INIT_BLOCKS(npages)	DIVROUNDUP(npages, 1U << MAX_ORDER)
+
 /*
  * The only zone present in the system.
  */
 static struct zone main_zone;
 
+/*
+ * An allocation of order > 0 failing for fragmentation runs
+ * a few passes of compaction, if they don't build a block it
+ * records its order and wakes up kcompactd. Both are
+ * protected by mem_lock.
+ */
+static struct wchan compact_wchan;
+static unsigned compact_order = 0;
+
 static inline bool above_page_swap_threshold(struct zone *zone)
 {
 	return SWAP_PAGE_THRESHOLD(zone->total_pages, zone->alloc_pages);
@@ -45,19 +85,35 @@ static inline bool vm_may_perform_swap(void)
 	return above_page_swap_threshold(&main_zone);
 }
 
-static walk_action_t choose_victim_page(struct page_table *pt, pte_t *pte, vaddr_t page_addr)
+/*
+ * State of a reclaim walk.
+ */
+struct reclaim_control {
+	struct page_table *local_pt;	/* page table of the current process */
+	struct tlb_batch tlb;		/* entries whose accessed bit was cleared */
+	bool swapped;			/* a page was moved to the swap memory */
+	int error;
+};
+
+static walk_action_t choose_victim_page(struct page_table *pt, pte_t *pte, vaddr_t page_addr, void *private)
 {
 	int retval;
 	struct page *page;
 	swap_entry_t entry;
+	struct reclaim_control *rc = private;
 
 	if (!pte_present(*pte) || pte_swap(*pte))
 		return WALK_REPEAT;
 
-	vm_tlb_flush_one(page_addr);
-
+	/*
+	 * The TLB is reloaded only for entries with the accessed bit
+	 * set, the invalidation of the cleared ones is batched: until
+	 * the batch is flushed a page can only look colder than it is.
+	 * Another process could be running on another cpu.
+	 */
 	if (pte_accessed(*pte)) {
 		pte_clear_accessed(pte);
+		vm_tlb_batch_add(&rc->tlb, page_addr, pt != rc->local_pt);
 		return WALK_REPEAT;
 	}
 
@@ -68,9 +124,15 @@ static walk_action_t choose_victim_page(struct page_table *pt, pte_t *pte, vaddr
 	if (user_page_mapcount(page) > 1)
 		return WALK_REPEAT;
 
+	/* the victim must not be reachable from any TLB */
+	vm_tlb_batch_add(&rc->tlb, page_addr, pt != rc->local_pt);
+	vm_tlb_batch_flush(&rc->tlb);
+
 	retval = swap_add_page(page, &entry);
-	if (retval)
-		panic("Could not add a page to the swap memory, page address: %08x\n", (unsigned)page);
+	if (retval) {
+		rc->error = retval;
+		return WALK_BREAK;
+	}
 
 	if (!user_page_put(page))
 		panic("Page was not freed when moved to the swap memory!\n");
@@ -78,20 +140,31 @@ static walk_action_t choose_victim_page(struct page_table *pt, pte_t *pte, vaddr
 	pte_set_swap(pte, entry);
 
 	pt_inc_page_count(pt, -1);
+	pt_inc_swap_count(pt, 1);
+	rc->swapped = true;
 
 	return WALK_BREAK;
 }
 
 /**
- * @brief Gets the current address space and walk the page table
- * trying to move a page from a `zone` to the swap memory.
+ * @brief Try to move a page from a `zone` to the swap memory.
+ * The address space exceeding its resident limit the most
+ * is walked first, then the one with the most pages outside
+ * of its working set, if there is none the current one is used.
  * 
- * @return int
+ * @return int error if any, ENOSPC if the swap memory is full
  */
 static int vm_try_swapin_page(void)
 {
 	struct addrspace *as;
 	struct proc *curr = curproc;
+	bool held;
+	struct reclaim_control rc = {
+		.local_pt = NULL,
+		.tlb = TLB_BATCH_INIT,
+		.swapped = false,
+		.error = 0,
+	};
 
 	// Check if we are in a kernel process
 	if (curr == NULL)
@@ -101,8 +174,48 @@ static int vm_try_swapin_page(void)
 	if (as == NULL)
 		return EINVAL;
 
-	// TODO: refactor: use walk_addrspace
-	return pt_walk_page_table(&as->pt, 0, USERSPACETOP, choose_victim_page);
+	/* the other threads can have the address space loaded too */
+	if (!proc_multithreaded(curr))
+		rc.local_pt = &as->pt;
+
+	as_walk_over_limit(choose_victim_page, &rc);
+	vm_tlb_batch_flush(&rc.tlb);
+	if (rc.swapped || rc.error)
+		return rc.error;
+
+	as_walk_coldest(choose_victim_page, &rc);
+	vm_tlb_batch_flush(&rc.tlb);
+	if (rc.swapped || rc.error)
+		return rc.error;
+
+	/* we could be called from the fault path, holding the lock already */
+	held = lock_do_i_hold(as->pt_lock);
+	if (!held)
+		lock_acquire(as->pt_lock);
+
+	pt_walk_page_table(&as->pt, 0, USERSPACETOP, choose_victim_page, &rc);
+	vm_tlb_batch_flush(&rc.tlb);
+
+	if (!held)
+		lock_release(as->pt_lock);
+
+	return rc.error;
+}
+
+/**
+ * @brief Shrinker hook of the reclaim path, releases the pages
+ * cached by the kernel heap and by the slab caches.
+ *
+ * @return unsigned number of pages given back to the zone
+ */
+static unsigned vm_shrink_kernel_caches(void)
+{
+	unsigned nfreed;
+
+	nfreed = kheap_shrink();
+	nfreed += kmem_cache_shrink_all();
+
+	return nfreed;
 }
 
 /*
@@ -149,12 +262,17 @@ static inline bool page_is_buddy(struct page *page, struct page *buddy, unsigned
  */
 static inline struct page *find_buddy_page(struct page *page, unsigned order)
 {
-	size_t page_pfn;
+	size_t page_pfn, buddy_pfn;
 	struct page *buddy;
 	
 	page_pfn = page_to_pfn(page);
+	buddy_pfn = find_buddy_pfn(page_pfn, order);
+
+	/* the blocks at the end of the RAM may have no buddy */
+	if (buddy_pfn >= READ_ONCE(initialized_pages))
+		return NULL;
 
-	buddy = pfn_to_page(find_buddy_pfn(page_pfn, order));
+	buddy = pfn_to_page(buddy_pfn);
 
 	if (page_is_buddy(page, buddy, order))
 		return buddy;
@@ -162,8 +280,8 @@ static inline struct page *find_buddy_page(struct page *page, unsigned order)
 }
 
 /**
- * @brief Create the page_table and initialize all the
- * pages.
+ * @brief Create the page_table, the pages are
+ * initialized by `zone_bootstrap`.
  * 
  */
 static void
@@ -175,9 +293,6 @@ page_table_bootstrap(void)
 
 	paddr_t paddr = ram_stealmem(DIVROUNDUP(npage * sizeof(struct page), PAGE_SIZE));
 	page_table = (void *)PADDR_TO_KVADDR(paddr);
-
-	for (size_t i = 0; i < npage; i++)
-		page_init(&page_table[i]);
 }
 
 /**
@@ -325,7 +440,95 @@ static void free_alloc_pages(struct zone *zone, struct page *page, unsigned orde
 }
 
 /**
- * @brief Bootstrap the memory zone.
+ * @brief Adds the pages in [start, end) to the buddy allocator,
+ * using the largest blocks aligned with their order. Used for
+ * the memory at the ends of the zone, that can not be split in
+ * max order blocks.
+ * 
+ * @param zone memory zone
+ * @param start first address of the range, page aligned
+ * @param end end of the range, page aligned
+ */
+static void zone_seed_range(struct zone *zone, vaddr_t start, vaddr_t end)
+{
+	struct page *page;
+	unsigned order;
+	size_t i;
+
+	KASSERT(spinlock_do_i_hold(&mem_lock));
+
+	while (start < end) {
+		for (order = MAX_ORDER; order > 0; order -= 1) {
+			if ((kvaddr_to_pfn(start) & ((1U << order) - 1)) == 0 &&
+					start + (PAGE_SIZE << order) <= end)
+				break;
+		}
+
+		page = kvaddr_to_page(start);
+
+		for (i = 0; i < (1U << order); i++)
+			page_init(&page[i]);
+
+		buddy_page_init(page);
+		add_page_to_free_list(zone, page, order);
+
+		start += PAGE_SIZE << order;
+	}
+}
+
+/**
+ * @brief Initialize the struct page of the next `nblocks`
+ * max order blocks of the zone, and hand them to the buddy
+ * allocator. The last pages of the RAM, not filling a whole
+ * block, are added as a single step.
+ * 
+ * @param zone memory zone
+ * @param nblocks number of blocks to add
+ * @return unsigned number of blocks added, 0 when all
+ * the memory has been initialized
+ */
+static unsigned zone_init_deferred(struct zone *zone, unsigned nblocks)
+{
+	struct page *page;
+	unsigned n;
+	size_t i;
+
+	KASSERT(spinlock_do_i_hold(&mem_lock));
+
+	for (n = 0;
+			n < nblocks &&
+			zone->deferred_addr + (PAGE_SIZE << MAX_ORDER) <= zone->last_valid_addr;
+			n += 1)
+	{
+		page = kvaddr_to_page(zone->deferred_addr);
+
+		for (i = 0; i < (1U << MAX_ORDER); i++)
+			page_init(&page[i]);
+
+		buddy_page_init(page);
+		add_page_to_free_list(zone, page, MAX_ORDER);
+
+		zone->deferred_addr += PAGE_SIZE << MAX_ORDER;
+		WRITE_ONCE(initialized_pages, kvaddr_to_pfn(zone->deferred_addr));
+	}
+
+	if (n < nblocks && zone->deferred_addr < zone->last_valid_addr) {
+		zone_seed_range(zone, zone->deferred_addr, zone->last_valid_addr);
+
+		zone->deferred_addr = zone->last_valid_addr;
+		WRITE_ONCE(initialized_pages, kvaddr_to_pfn(zone->deferred_addr));
+		n += 1;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Bootstrap the memory zone. Only the pages used by
+ * the kernel so far and EAGER_INIT_PAGES pages are
+ * initialized, the rest is left to the deferred init.
+ * The zone starts at the first free page, the pages up to
+ * the first max order block are seeded with lower orders.
  * 
  */
 static void
@@ -333,32 +536,497 @@ zone_bootstrap(void)
 {
 	struct free_area *area;
 	unsigned order;
-	vaddr_t first, last;
-	struct page *page;
 	struct zone *zone;
+	vaddr_t aligned_addr;
+	size_t i;
 	
 	zone = &main_zone;
 	
 	zone->last_valid_addr = PADDR_TO_KVADDR(ram_getsize());
-	zone->first_valid_addr = ROUNDUP(PADDR_TO_KVADDR(ram_getfirstfree()), PAGE_SIZE << MAX_ORDER);
+	zone->first_valid_addr = ROUNDUP(PADDR_TO_KVADDR(ram_getfirstfree()), PAGE_SIZE);
 	zone->alloc_pages = 0;
 	zone->total_pages = (zone->last_valid_addr - zone->first_valid_addr) / PAGE_SIZE;
 
+	aligned_addr = ROUNDUP(zone->first_valid_addr, PAGE_SIZE << MAX_ORDER);
+	if (aligned_addr > zone->last_valid_addr)
+		aligned_addr = zone->last_valid_addr;
+	zone->deferred_addr = aligned_addr;
+
 	for_each_free_area(zone->free_area, area, order) {
 		INIT_LIST_HEAD(&area->free_list);
 	}
 
-	/* Insert all the max order pages in the buddy */
-	last = zone->last_valid_addr;
-	first = zone->first_valid_addr;
-	for (; first < last; first += PAGE_SIZE << MAX_ORDER) {
-		page = kvaddr_to_page(first);
-		buddy_page_init(page);
-		add_page_to_free_list(zone, page, MAX_ORDER);
+	wchan_init(&compact_wchan, "kcompactd");
+
+	/* pages before the zone, never handed to the buddy */
+	for (i = 0; i < kvaddr_to_pfn(zone->first_valid_addr); i++)
+		page_init(&page_table[i]);
+
+	spinlock_acquire(&mem_lock);
+	zone_seed_range(zone, zone->first_valid_addr, aligned_addr);
+	initialized_pages = kvaddr_to_pfn(aligned_addr);
+
+	zone_init_deferred(zone, INIT_BLOCKS(EAGER_INIT_PAGES));
+	spinlock_release(&mem_lock);
+}
+
+static void
+vm_deferred_init_thread(void *ign, unsigned long ign2)
+{
+	unsigned n;
+
+	(void)ign;
+	(void)ign2;
+
+	do {
+		spinlock_acquire(&mem_lock);
+		n = zone_init_deferred(&main_zone, INIT_BLOCKS(DEFERRED_INIT_BATCH));
+		spinlock_release(&mem_lock);
+
+		thread_yield();
+	} while (n > 0);
+}
+
+/**
+ * @brief Starts the thread that initializes the pages
+ * left out by `vm_bootstrap` and feeds them to the
+ * buddy allocator.
+ * 
+ */
+void
+vm_deferred_init_bootstrap(void)
+{
+	int retval;
+
+	retval = thread_fork("pageinit", NULL, vm_deferred_init_thread, NULL, 0);
+	if (retval)
+		panic("vm_deferred_init_bootstrap: could not start pageinit: %s\n", strerror(retval));
+}
+
+/**
+ * @brief Compute the fragmentation index of the zone for
+ * an allocation of `order`, the value is scaled by 1000.
+ * 
+ * A value tending to 0 means that an allocation would fail
+ * due to lack of memory, a value tending to 1000 means that
+ * the allocation would fail due to fragmentation. If a block
+ * of the requested order is available -1000 is returned.
+ * 
+ * @param zone memory zone
+ * @param order order of the allocation
+ * @return int fragmentation index
+ */
+static int zone_fragmentation_index(struct zone *zone, unsigned order)
+{
+	size_t free_pages = 0;
+	size_t free_blocks = 0;
+	size_t suitable_blocks = 0;
+	size_t requested = 1 << order;
+	unsigned current_order;
+
+	for (current_order = 0; current_order <= MAX_ORDER; current_order += 1) {
+		size_t n_free = zone->free_area[current_order].n_free;
+
+		free_blocks += n_free;
+		free_pages += n_free << current_order;
+		if (current_order >= order)
+			suitable_blocks += n_free;
+	}
+
+	if (free_blocks == 0)
+		return 0;
+
+	if (suitable_blocks)
+		return -1000;
+
+	return 1000 - (int)((1000 + (free_pages * 1000) / requested) / free_blocks);
+}
+
+/*
+ * Under this fragmentation index an allocation fails for
+ * lack of memory, so there is no point in compacting the zone.
+ */
+#define COMPACT_FRAG_THRESHOLD 500
+
+/*
+ * Passes kcompactd runs for a request at most, and the
+ * ones an allocation runs itself before giving up.
+ */
+#define COMPACT_MAX_PASSES 8
+#define COMPACT_DIRECT_PASSES 2
+
+/**
+ * @brief State of the compaction of a block.
+ * 
+ */
+struct compact_control {
+	struct page *block;	/* first page of the block being compacted */
+	unsigned order;		/* order of the block */
+	size_t nr_used;		/* number of pages in use in the block */
+	size_t nr_migrated;	/* number of pages moved out of the block */
+	int error;		/* error that stopped the migration, if any */
+};
+
+static inline bool page_in_block(struct compact_control *cc, struct page *page)
+{
+	return page >= cc->block && page < cc->block + (1 << cc->order);
+}
+
+/**
+ * @brief Count the pages in use in the block starting at `block`,
+ * fails if the block contains any page that cannot be moved.
+ * Only the user pages mapped by a single pte can be migrated.
+ * 
+ * @param block first page of the block
+ * @param order order of the block
+ * @param used returns the number of pages to migrate
+ * @return true if the block can be compacted
+ */
+static bool compact_block_movable(struct page *block, unsigned order, size_t *used)
+{
+	size_t i;
+	struct page *page;
+
+	*used = 0;
+
+	for (i = 0; i < (1U << order); ) {
+		page = &block[i];
+
+		if (page->flags == PGF_BUDDY) {
+			i += 1 << page_get_order(page);
+			continue;
+		}
+
+		if (page->flags != PGF_USER ||
+				page_get_order(page) != 0 ||
+				user_page_mapcount(page) > 1)
+			return false;
+
+		*used += 1;
+		i += 1;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Find the block of `order` that is cheaper to compact,
+ * that is the one with the lowest number of pages to migrate.
+ * 
+ * @param zone memory zone
+ * @param order order of the block
+ * @param nr_used returns the number of pages to migrate
+ * @return struct page* first page of the block or NULL if none
+ * can be compacted
+ */
+static struct page *compact_find_block(struct zone *zone, unsigned order, size_t *nr_used)
+{
+	struct page *block, *best = NULL;
+	size_t used, best_used = (size_t)-1;
+	size_t free_pages = zone->total_pages - zone->alloc_pages;
+	vaddr_t addr;
+
+	KASSERT(spinlock_do_i_hold(&mem_lock));
+
+	for (addr = ROUNDUP(zone->first_valid_addr, PAGE_SIZE << order);
+			addr + (PAGE_SIZE << order) <= zone->deferred_addr;
+			addr += PAGE_SIZE << order)
+	{
+		block = kvaddr_to_page(addr);
+
+		if (!compact_block_movable(block, order, &used))
+			continue;
+
+		/* the migrated pages must fit outside of the block */
+		if (used >= best_used || free_pages < (1U << order))
+			continue;
+
+		best = block;
+		best_used = used;
+	}
+
+	*nr_used = best_used;
+
+	return best;
+}
+
+/**
+ * @brief Remove the free pages of the block from the
+ * buddy allocator, so they can not be allocated or
+ * merged while the block is being compacted.
+ * 
+ * @param zone memory zone
+ * @param cc compaction state
+ */
+static void compact_isolate_block(struct zone *zone, struct compact_control *cc)
+{
+	size_t i;
+	unsigned order;
+	struct page *page;
+
+	KASSERT(spinlock_do_i_hold(&mem_lock));
+
+	for (i = 0; i < (1U << cc->order); ) {
+		page = &cc->block[i];
+
+		if (page->flags != PGF_BUDDY) {
+			i += 1;
+			continue;
+		}
+
+		order = page_get_order(page);
+		del_page_from_free_list(zone, page, order);
+		zone->alloc_pages += 1 << order;
+		page->flags = PGF_ISOLATED;
+
+		i += 1 << order;
+	}
+}
+
+/**
+ * @brief Give back the isolated pages of the block to the
+ * buddy allocator, if every page was migrated they merge
+ * into a block of the compacted order.
+ * 
+ * @param zone memory zone
+ * @param cc compaction state
+ */
+static void compact_release_block(struct zone *zone, struct compact_control *cc)
+{
+	size_t i;
+	unsigned order;
+	struct page *page;
+
+	KASSERT(spinlock_do_i_hold(&mem_lock));
+
+	for (i = 0; i < (1U << cc->order); ) {
+		page = &cc->block[i];
+
+		if (page->flags != PGF_ISOLATED) {
+			i += 1;
+			continue;
+		}
+
+		order = page_get_order(page);
+		free_alloc_pages(zone, page, order);
+
+		i += 1 << order;
+	}
+}
+
+/**
+ * @brief Move a user page out of the block being compacted,
+ * the content is copied in a new page and the pte is
+ * updated to point to it.
+ * 
+ * The pte is cleared and the TLB entry shot down before the
+ * copy, this way no CPU can write to the old page while
+ * it's being copied.
+ */
+static walk_action_t migrate_user_page(struct page_table *pt, pte_t *pte, vaddr_t page_addr, void *private)
+{
+	struct compact_control *cc = private;
+	struct page *page, *new_page;
+	pteflags_t flags;
+
+	(void)pt;
+
+	if (cc->error)
+		return WALK_BREAK;
+
+	if (!pte_present(*pte) || pte_swap(*pte))
+		return WALK_CONTINUE;
+
+	page = pte_page(*pte);
+	if (!page_in_block(cc, page))
+		return WALK_CONTINUE;
+
+	if (page->flags != PGF_USER || user_page_mapcount(page) > 1)
+		return WALK_CONTINUE;
+
+	spinlock_acquire(&mem_lock);
+	new_page = get_free_pages(&main_zone, 0);
+	spinlock_release(&mem_lock);
+
+	if (!new_page) {
+		cc->error = ENOMEM;
+		return WALK_BREAK;
 	}
 
-	/* Assert that all the available pages are allocated in the free_list */
-	KASSERT(zone->free_area[MAX_ORDER].n_free == (zone->last_valid_addr - zone->first_valid_addr) / (PAGE_SIZE << MAX_ORDER));
+	/* a page of the block was freed and merged in the meantime */
+	if (page_in_block(cc, new_page)) {
+		free_pages(new_page);
+		cc->error = EAGAIN;
+		return WALK_BREAK;
+	}
+
+	user_page_init(new_page);
+
+	flags = pte_flags(*pte);
+	pte_clear(pte);
+	vm_tlb_shootdown(page_addr);
+
+	copy_page(new_page, page);
+
+	pte_set_page(pte, page_to_kvaddr(new_page), flags);
+
+	user_page_put(page);
+	cc->nr_migrated += 1;
+
+	return WALK_CONTINUE;
+}
+
+/**
+ * @brief Try to create a free block of `order` by moving
+ * the user pages of a fragmented block somewhere else.
+ * 
+ * @param zone memory zone
+ * @param order order of the requested block
+ * @param page if not NULL, returns a block of `order` taken
+ * before anyone else can split it, or NULL
+ * @return int EAGAIN if some page of the block was not moved,
+ * ENOMEM if no block can be compacted
+ */
+static int compact_zone(struct zone *zone, unsigned order, struct page **page)
+{
+	struct compact_control cc = {
+		.block = NULL,
+		.order = order,
+		.nr_used = 0,
+		.nr_migrated = 0,
+		.error = 0,
+	};
+	int retval;
+
+	spinlock_acquire(&mem_lock);
+	if (zone_fragmentation_index(zone, order) > COMPACT_FRAG_THRESHOLD)
+		cc.block = compact_find_block(zone, order, &cc.nr_used);
+	if (cc.block)
+		compact_isolate_block(zone, &cc);
+	spinlock_release(&mem_lock);
+
+	if (!cc.block)
+		return ENOMEM;
+
+	retval = as_walk_all(0, USERSPACETOP, migrate_user_page, &cc);
+
+	spinlock_acquire(&mem_lock);
+	compact_release_block(zone, &cc);
+	if (page)
+		*page = get_free_pages(zone, order);
+	spinlock_release(&mem_lock);
+
+	if (retval)
+		return retval;
+
+	if (cc.error)
+		return cc.error;
+
+	/* the walk skipped a page, its page table was locked */
+	if (cc.nr_migrated < cc.nr_used)
+		return EAGAIN;
+
+	return 0;
+}
+
+static bool zone_has_block(struct zone *zone, unsigned order)
+{
+	KASSERT(spinlock_do_i_hold(&mem_lock));
+
+	for (; order <= MAX_ORDER; order++) {
+		if (zone->free_area[order].n_free > 0)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Asks kcompactd for a free block of `order`,
+ * the allocation that failed doesn't wait for it.
+ * 
+ * @param order order of the failed allocation
+ */
+static void compact_wakeup(unsigned order)
+{
+	spinlock_acquire(&mem_lock);
+	if (order > compact_order)
+		compact_order = order;
+	wchan_wakeone(&compact_wchan, &mem_lock);
+	spinlock_release(&mem_lock);
+}
+
+/**
+ * @brief Direct compaction, builds a block of `order` for
+ * the allocation that failed for fragmentation. It runs
+ * a few passes, then kcompactd is left to build one for
+ * the next request.
+ * 
+ * @param order order of the failed allocation
+ * @return struct page* the block, or NULL
+ */
+static struct page *compact_alloc(unsigned order)
+{
+	struct page *page = NULL;
+	unsigned pass;
+	int retval;
+
+	for (pass = 0; pass < COMPACT_DIRECT_PASSES; pass++) {
+		retval = compact_zone(&main_zone, order, &page);
+		if (page || retval)
+			break;
+	}
+
+	if (!page)
+		compact_wakeup(order);
+
+	return page;
+}
+
+static void
+vm_compact_thread(void *ign, unsigned long ign2)
+{
+	unsigned order;
+	unsigned pass;
+	bool done;
+
+	(void)ign;
+	(void)ign2;
+
+	for (;;) {
+		spinlock_acquire(&mem_lock);
+		while (compact_order == 0)
+			wchan_sleep(&compact_wchan, &mem_lock);
+
+		order = compact_order;
+		compact_order = 0;
+		spinlock_release(&mem_lock);
+
+		/* stop at the first pass that can't build a block */
+		for (pass = 0; pass < COMPACT_MAX_PASSES; pass++) {
+			spinlock_acquire(&mem_lock);
+			done = zone_has_block(&main_zone, order);
+			spinlock_release(&mem_lock);
+
+			if (done || compact_zone(&main_zone, order, NULL))
+				break;
+		}
+	}
+}
+
+/**
+ * @brief Starts kcompactd, the thread that builds the
+ * high order blocks the allocations could not find.
+ * 
+ */
+void
+vm_compact_bootstrap(void)
+{
+	int retval;
+
+	retval = thread_fork("kcompactd", NULL, vm_compact_thread, NULL, 0);
+	if (retval)
+		panic("vm_compact_bootstrap: could not start kcompactd: %s\n", strerror(retval));
 }
 
 static void zone_print_info(void)
@@ -366,6 +1034,7 @@ static void zone_print_info(void)
 	kprintf("vm initiazed with:\n");
 	kprintf("\t%10d: total physical pages\n", total_pages);
 	kprintf("\t%10d: available physical pages\n", main_zone.total_pages);
+	kprintf("\t%10d: initialized physical pages\n", READ_ONCE(initialized_pages));
 	kprintf("\t0x%08x: first available address\n", main_zone.first_valid_addr);
 	kprintf("\t0x%08x: last available address\n", main_zone.last_valid_addr);
 	kprintf("\n");
@@ -384,8 +1053,13 @@ static void buddy_print_info(void)
 
 	for (order = 0; order <= MAX_ORDER; order += 1) {
 		unsigned n_free = main_zone.free_area[order].n_free;
+		int frag_index = zone_fragmentation_index(&main_zone, order);
 
-		kprintf("order: %2d: free pages:\t%8d\n", order, n_free);
+		if (frag_index < 0)
+			kprintf("order: %2d: free pages:\t%8d\tfrag index:     -\n", order, n_free);
+		else
+			kprintf("order: %2d: free pages:\t%8d\tfrag index: %d.%03d\n",
+					order, n_free, frag_index / 1000, frag_index % 1000);
 	}
 }
 
@@ -396,7 +1070,10 @@ static void page_print_info(void)
 	size_t alloc_pages = 0;
 	size_t free_pages = 0;
 
-	for (i = 0, page = &page_table[i]; i < total_pages; i += 1, page = &page_table[i]) {
+	size_t npages = READ_ONCE(initialized_pages);
+
+	/* the pages not initialized yet are all free */
+	for (i = 0, page = &page_table[i]; i < npages; i += 1, page = &page_table[i]) {
 		if (page->flags == PGF_BUDDY) {
 			free_pages += 1 << page->buddy_order;
 			i += (1 << page->buddy_order) - 1;
@@ -416,6 +1093,46 @@ static void page_print_info(void)
 		kprintf("[Warning] Calculated alloc pages are differnt from the ones stored in main_zone!\n");
 }
 
+/**
+ * @brief Counts the user pages mapped more than once. The
+ * page table is scanned under mem_lock, which is dropped
+ * every FREE_PAGES_BATCH pages.
+ * 
+ * @param shared set to the number of pages with more than one mapping
+ * @param sharing set to the number of mappings of those pages
+ * beyond the first one, i.e. the pages saved
+ */
+void user_pages_shared(size_t *shared, size_t *sharing)
+{
+	size_t i, npages = READ_ONCE(initialized_pages);
+	struct page *page;
+	unsigned mapcount;
+
+	*shared = 0;
+	*sharing = 0;
+
+	spinlock_acquire(&mem_lock);
+
+	for (i = 0; i < npages; i++) {
+		if (i % FREE_PAGES_BATCH == 0) {
+			spinlock_release(&mem_lock);
+			spinlock_acquire(&mem_lock);
+		}
+
+		page = &page_table[i];
+		if (page->flags != PGF_USER)
+			continue;
+
+		mapcount = user_page_mapcount(page);
+		if (mapcount > 1) {
+			*shared += 1;
+			*sharing += mapcount - 1;
+		}
+	}
+
+	spinlock_release(&mem_lock);
+}
+
 /*
  * Check if we're in a context that can sleep. While most of the
  * operations in dumbvm don't in fact sleep, in a real VM system many
@@ -441,6 +1158,7 @@ vm_bootstrap(void)
 	page_table_bootstrap();
 	zone_bootstrap();
 	zone_print_info();
+	as_bootstrap();
 }
 
 /**
@@ -484,13 +1202,6 @@ free_kpages(vaddr_t addr)
 	free_pages(kvaddr_to_page(addr));
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
-
 void
 vm_kpages_stats(void)
 {
@@ -518,24 +1229,73 @@ struct page *alloc_pages(size_t npages)
 {
 	struct page *page;
 	bool do_swap_page;
+	/* no swap attempted counts as a failure */
+	int retval = ENOSPC;
 
 	vm_can_sleep();
 
 	compiletime_assert(get_order(1) == 0, "Order of 1 is not 0!");
 	unsigned order = get_order(npages);
 
+	/* larger than any block, no process has to be killed for it */
+	if (order > MAX_ORDER)
+		return NULL;
+
 	spinlock_acquire(&mem_lock);
 	page = get_free_pages(&main_zone, order);
+	/* the deferred init is behind, initialize some memory now */
+	if (!page && zone_init_deferred(&main_zone, INIT_BLOCKS(DEFERRED_INIT_ON_DEMAND)))
+		page = get_free_pages(&main_zone, order);
 	do_swap_page = vm_may_perform_swap();
 	spinlock_release(&mem_lock);
 
+	/*
+	 * Out of memory, the kernel caches could be
+	 * holding unused pages: give them back and retry.
+	 */
+	if (!page && vm_shrink_kernel_caches()) {
+		spinlock_acquire(&mem_lock);
+		page = get_free_pages(&main_zone, order);
+		spinlock_release(&mem_lock);
+	}
+
+	/*
+	 * A high order request can fail even when there are
+	 * enough free pages, if the memory is fragmented
+	 * build a block now.
+	 */
+	if (!page && order > 0)
+		page = compact_alloc(order);
+
 	/*
 	 * If the memory is filling up and we are
 	 * in a user process try to move some
 	 * page to the swap memory.
 	 */
 	if (do_swap_page)
-		vm_try_swapin_page();
+		retval = vm_try_swapin_page();
+
+	/* a page went to the swap memory, it can be used now */
+	if (!page && order == 0 && !retval) {
+		spinlock_acquire(&mem_lock);
+		page = get_free_pages(&main_zone, order);
+		spinlock_release(&mem_lock);
+	}
+
+	/*
+	 * Both the memory and the swap memory are exhausted,
+	 * free some space killing a process. The high order
+	 * requests fail for fragmentation, not for lack of
+	 * memory, and they don't kill anyone.
+	 */
+	if (!page && order == 0 && retval && proc_getas() != NULL) {
+		/* sleeps until the victim released its pages */
+		oom_kill_process();
+
+		spinlock_acquire(&mem_lock);
+		page = get_free_pages(&main_zone, order);
+		spinlock_release(&mem_lock);
+	}
 
 	if (page)
 		KASSERT(page->buddy_order == (unsigned)get_order(npages));
@@ -558,6 +1318,37 @@ void free_pages(struct page *page)
 	spinlock_release(&mem_lock);
 }
 
+/**
+ * @brief Frees a list of pages linked through `buddy_list`,
+ * the allocator lock is taken once every `FREE_PAGES_BATCH`
+ * pages instead of once per page.
+ * 
+ * @param page_list list of pages to free, empty on return
+ */
+void free_pages_list(struct list_head *page_list)
+{
+	struct page *page, *tmp;
+	unsigned batch = 0;
+
+	spinlock_acquire(&mem_lock);
+
+	list_for_each_entry_safe(page, tmp, page_list, buddy_list) {
+		KASSERT(page_get_order(page) <= MAX_ORDER);
+
+		/* the entry is reused by the buddy allocator */
+		list_del(&page->buddy_list);
+		free_alloc_pages(&main_zone, page, page_get_order(page));
+
+		if (++batch == FREE_PAGES_BATCH) {
+			batch = 0;
+			spinlock_release(&mem_lock);
+			spinlock_acquire(&mem_lock);
+		}
+	}
+
+	spinlock_release(&mem_lock);
+}
+
 /**
  * @brief Allocates a page for the user.
  * 
@@ -0,0 +1,565 @@
+#include <pt.h>
+#include <machine/pt.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <spinlock.h>
+#include <hashtable.h>
+#include <addrspace.h>
+#include <page.h>
+#include <swap.h>
+#include <slab.h>
+#include "opt-hashpt.h"
+
+/*
+ * Hashed page table, it replaces the two level page table
+ * of vm/pt.c keeping the same interface. Every address space
+ * only pays for the entries it uses, instead of one PMD page
+ * plus one PTE page for each 4MB region touched.
+ */
+#if OPT_HASHPT
+
+#define HPT_HASH_BITS (12)
+
+/*
+ * Swap entries collected by a teardown before
+ * they are released together.
+ */
+#define HPT_FREE_SWAP_BATCH (64)
+
+/**
+ * @brief One entry of the hashed page table, the
+ * `pte_t` returned by the API points inside of it.
+ *
+ */
+struct hpt_entry {
+    struct hlist_node hash_link;    /* entry in hpt_table */
+    struct list_head pt_link;       /* entry in the list of the page table, sorted by address */
+    struct page_table *pt;          /* owner of the entry */
+    vaddr_t vaddr;                  /* virtual page mapped */
+    pte_t pte;
+};
+
+/*
+ * Entries of all the page tables. The chains are protected
+ * by `hpt_lock`, the content of an entry by the page table
+ * lock of its address space.
+ */
+static DEFINE_HASHTABLE(hpt_table, HPT_HASH_BITS);
+static struct spinlock hpt_lock = SPINLOCK_INITIALIZER;
+static size_t hpt_nr_entries = 0;
+
+static DEFINE_KMEM_CACHE(hpt_entry_cache, struct hpt_entry, NULL);
+
+/**
+ * @brief State of a page table teardown, the frames
+ * and swap entries released are gathered here and
+ * given back in batches.
+ *
+ */
+struct hpt_free_batch {
+    struct list_head pages;                 /* frames to give back to the buddy allocator */
+    swap_entry_t swap[HPT_FREE_SWAP_BATCH]; /* swap entries to release */
+    size_t nr_swap;                         /* number of entries in `swap` */
+};
+
+static inline uint32_t hpt_key(struct page_table *pt, vaddr_t addr)
+{
+    return (uint32_t)(addr >> PAGE_SHIFT) ^ (uint32_t)((vaddr_t)pt >> 4);
+}
+
+static inline void hpt_update_table_pages(struct page_table *pt)
+{
+    pt->table_pages = DIVROUNDUP(pt->nr_entries * hpt_entry_cache.size, PAGE_SIZE);
+}
+
+static struct hpt_entry *hpt_lookup(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry;
+
+    addr &= PAGE_FRAME;
+
+    spinlock_acquire(&hpt_lock);
+
+    hash_for_each_possible(hpt_table, entry, hash_link, hpt_key(pt, addr)) {
+        if (entry->pt == pt && entry->vaddr == addr)
+            goto out;
+    }
+
+    entry = NULL;
+
+out:
+    spinlock_release(&hpt_lock);
+
+    return entry;
+}
+
+/**
+ * @brief Allocates a `none` entry for `addr`, the caller
+ * must have checked that the address is not mapped.
+ *
+ * @return struct hpt_entry* NULL if no memory is available
+ */
+static struct hpt_entry *hpt_insert(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry, *pos;
+
+    entry = kmem_cache_alloc(&hpt_entry_cache);
+    if (!entry)
+        return NULL;
+
+    entry->pt = pt;
+    entry->vaddr = addr & PAGE_FRAME;
+    entry->pte = PTE_INIT;
+    INIT_HLIST_NODE(&entry->hash_link);
+
+    spinlock_acquire(&hpt_lock);
+    hash_add(hpt_table, &entry->hash_link, hpt_key(pt, entry->vaddr));
+    hpt_nr_entries += 1;
+    spinlock_release(&hpt_lock);
+
+    /*
+     * Keep the list sorted, a resumed walk starts from an
+     * address. The new pages are mostly the highest ones,
+     * the search starts from the tail.
+     */
+    list_for_each_entry_reverse(pos, &pt->entries, pt_link) {
+        if (pos->vaddr < entry->vaddr)
+            break;
+    }
+    list_add(&entry->pt_link, &pos->pt_link);
+    pt->nr_entries += 1;
+    hpt_update_table_pages(pt);
+
+    return entry;
+}
+
+static void hpt_remove(struct hpt_entry *entry)
+{
+    struct page_table *pt = entry->pt;
+
+    spinlock_acquire(&hpt_lock);
+    hash_del(&entry->hash_link);
+    hpt_nr_entries -= 1;
+    spinlock_release(&hpt_lock);
+
+    list_del(&entry->pt_link);
+    pt->nr_entries -= 1;
+    hpt_update_table_pages(pt);
+
+    kmem_cache_free(&hpt_entry_cache, entry);
+}
+
+static struct hpt_entry *hpt_get_or_insert(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry;
+
+    /* only the holder of the page table lock inserts entries of `pt` */
+    entry = hpt_lookup(pt, addr);
+    if (entry)
+        return entry;
+
+    return hpt_insert(pt, addr);
+}
+
+static void hpt_free_batch_flush_swap(struct hpt_free_batch *batch)
+{
+    if (batch->nr_swap == 0)
+        return;
+
+    swap_dec_pages(batch->swap, batch->nr_swap);
+    batch->nr_swap = 0;
+}
+
+int pt_init(struct page_table *pt)
+{
+    KASSERT(pt != NULL);
+
+    INIT_LIST_HEAD(&pt->entries);
+    pt->nr_entries = 0;
+    pt->total_pages = 0;
+    pt->swap_pages = 0;
+    pt->table_pages = 0;
+
+    return 0;
+}
+
+void pt_destroy(struct page_table *pt)
+{
+    struct hpt_entry *entry, *tmp;
+    struct hpt_free_batch batch = {
+        .pages = LIST_HEAD_INIT(batch.pages),
+        .nr_swap = 0,
+    };
+
+    KASSERT(pt != NULL);
+
+    /* unlink all the entries taking the hash lock once */
+    spinlock_acquire(&hpt_lock);
+    list_for_each_entry(entry, &pt->entries, pt_link) {
+        hash_del(&entry->hash_link);
+        hpt_nr_entries -= 1;
+    }
+    spinlock_release(&hpt_lock);
+
+    list_for_each_entry_safe(entry, tmp, &pt->entries, pt_link) {
+        if (pte_swap(entry->pte)) {
+            batch.swap[batch.nr_swap++] = pte_swap_entry(entry->pte);
+            if (batch.nr_swap == HPT_FREE_SWAP_BATCH)
+                hpt_free_batch_flush_swap(&batch);
+
+            pt->swap_pages -= 1;
+        } else if (pte_present(entry->pte)) {
+            user_page_put_deferred(pte_page(entry->pte), &batch.pages);
+            pt->total_pages -= 1;
+        }
+
+        list_del(&entry->pt_link);
+        kmem_cache_free(&hpt_entry_cache, entry);
+    }
+
+    hpt_free_batch_flush_swap(&batch);
+    free_pages_list(&batch.pages);
+
+    pt->nr_entries = 0;
+    pt->table_pages = 0;
+
+    KASSERT(pt->total_pages == 0);
+    KASSERT(pt->swap_pages == 0);
+}
+
+/**
+ * @brief get the pte of a specific address if present,
+ * otherwise allocate a new `none` entry.
+ *
+ * @param pt page table
+ * @param addr address to the pte
+ * @return returns the pte_entry or NULL no memory is available
+ */
+pte_t *pt_get_or_alloc_pte(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry;
+
+    KASSERT(pt != NULL);
+
+    entry = hpt_get_or_insert(pt, addr);
+    if (!entry)
+        return NULL;
+
+    return &entry->pte;
+}
+
+/**
+ * @brief Account a `none` entry that has just been populated,
+ * the entry already exists so there is nothing to do.
+ *
+ * @param pte_entry entry returned by `pt_get_or_alloc_pte`
+ */
+void pt_pte_populated(pte_t *pte_entry)
+{
+    KASSERT(pte_entry != NULL);
+    KASSERT(!pte_none(*pte_entry));
+}
+
+/**
+ * @brief Free the entry of `addr` if it was allocated
+ * but never populated.
+ *
+ * @param pt page table
+ * @param addr address of the entry
+ * @return true if the entry was freed
+ */
+bool pt_free_empty_pte(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry;
+
+    KASSERT(pt != NULL);
+
+    entry = hpt_lookup(pt, addr);
+    if (!entry || !pte_none(entry->pte))
+        return false;
+
+    hpt_remove(entry);
+
+    return true;
+}
+
+/**
+ * @brief Clear a populated entry of the page table, the
+ * caller is in charge of the page or swap entry it was
+ * pointing to and may have already cleared the entry.
+ * The entry is freed, so it must not be called from
+ * a `walk_ops_t`.
+ *
+ * @param pt page table
+ * @param addr address of the entry
+ */
+void pt_clear_pte(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry;
+
+    KASSERT(pt != NULL);
+
+    entry = hpt_lookup(pt, addr);
+    KASSERT(entry != NULL);
+
+    hpt_remove(entry);
+}
+
+/**
+ * @brief Unmaps every page between `start` and `end`, the
+ * pages and swap entries are released with their entries.
+ * The caller holds the page table lock and invalidates
+ * the TLB.
+ *
+ * @param pt page table
+ * @param start first address of the range
+ * @param end end of the range
+ */
+void pt_unmap_range(struct page_table *pt, vaddr_t start, vaddr_t end)
+{
+    struct hpt_entry *entry;
+    struct hpt_free_batch batch = {
+        .pages = LIST_HEAD_INIT(batch.pages),
+        .nr_swap = 0,
+    };
+
+    KASSERT(pt != NULL);
+    KASSERT(start <= end);
+
+    for (start &= PAGE_FRAME; start < end; start += PAGE_SIZE) {
+        entry = hpt_lookup(pt, start);
+        if (!entry)
+            continue;
+
+        if (pte_swap(entry->pte)) {
+            batch.swap[batch.nr_swap++] = pte_swap_entry(entry->pte);
+            if (batch.nr_swap == HPT_FREE_SWAP_BATCH)
+                hpt_free_batch_flush_swap(&batch);
+
+            pt->swap_pages -= 1;
+        } else if (pte_present(entry->pte)) {
+            user_page_put_deferred(pte_page(entry->pte), &batch.pages);
+            pt->total_pages -= 1;
+        }
+
+        hpt_remove(entry);
+    }
+
+    hpt_free_batch_flush_swap(&batch);
+    free_pages_list(&batch.pages);
+}
+
+int pt_alloc_page(struct page_table *pt, vaddr_t addr, struct pt_page_flags flags, paddr_t *paddr)
+{
+    struct hpt_entry *entry;
+    struct page *page;
+
+    KASSERT(pt != NULL);
+
+    pteflags_t page_flags = PAGE_PRESENT |
+            (flags.page_rw * PAGE_RW) |
+            (flags.page_pwt * PAGE_PWT);
+
+    entry = hpt_get_or_insert(pt, addr);
+    if (!entry)
+        return ENOMEM;
+
+    /* allocate a page if it is not present */
+    if (pte_none(entry->pte)) {
+        page = alloc_user_zeroed_page();
+        if (!page) {
+            hpt_remove(entry);
+            return ENOMEM;
+        }
+
+        pt->total_pages += 1;
+
+        pte_set_page(&entry->pte, page_to_kvaddr(page), page_flags);
+    } else {
+        pte_clear_flags(&entry->pte);
+        pte_set_flags(&entry->pte, page_flags);
+    }
+
+    *paddr = pte_paddr(entry->pte);
+
+    return 0;
+}
+
+/**
+ * @brief Allocates a range of pages indide a page table,
+ * the range considered is [start, end), `end` is considered
+ * strictly less. If the table has a not `none` pte, it
+ * will be skipped.
+ *
+ * @param pt page table
+ * @param start starting address of the range (included)
+ * @param end ending address of the range (not included)
+ * @param flags flags of the page
+ * @return int error if any
+ */
+int pt_alloc_page_range(struct page_table *pt, vaddr_t start, vaddr_t end, struct pt_page_flags flags)
+{
+    struct hpt_entry *entry;
+    struct page *page;
+
+    KASSERT(pt != NULL);
+    KASSERT(start <= end);
+
+    pteflags_t page_flags = PAGE_PRESENT |
+            (flags.page_rw * PAGE_RW) |
+            (flags.page_pwt * PAGE_PWT);
+
+    for (start &= PAGE_FRAME; start < end; start += PAGE_SIZE) {
+        entry = hpt_get_or_insert(pt, start);
+        if (!entry)
+            return ENOMEM;
+
+        if (!pte_none(entry->pte))
+            continue;
+
+        page = alloc_user_zeroed_page();
+        if (!page) {
+            hpt_remove(entry);
+            return ENOMEM;
+        }
+
+        pt->total_pages += 1;
+
+        pte_set_page(&entry->pte, page_to_kvaddr(page), page_flags);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Calls `f` on the populated entries in [start, end),
+ * in address order. `f` can change an entry but not clear it.
+ *
+ */
+int pt_walk_page_table(struct page_table *pt, vaddr_t start, vaddr_t end, walk_ops_t f, void *private)
+{
+    struct hpt_entry *entry;
+
+    KASSERT(pt != NULL);
+    KASSERT(start <= end);
+
+    list_for_each_entry(entry, &pt->entries, pt_link) {
+        if (entry->vaddr < start)
+            continue;
+
+        if (entry->vaddr >= end)
+            break;
+
+        if (pte_none(entry->pte))
+            continue;
+
+        if (f(pt, &entry->pte, entry->vaddr, private) == WALK_BREAK)
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the Physical Address from a Virtual Address, if
+ * the page is not present return 0.
+ *
+ * @param pt
+ * @param addr
+ * @return paddr_t
+ */
+paddr_t pt_get_paddr(struct page_table *pt, vaddr_t addr)
+{
+    struct hpt_entry *entry;
+
+    entry = hpt_lookup(pt, addr);
+    if (!entry || !pte_present(entry->pte))
+        return 0;
+
+    return pte_paddr(entry->pte);
+}
+
+/**
+ * @brief Copy the `old` page table to the
+ * `new` page table. The copy is done incrementing the
+ * refcount of the page pointed by the `pte`s, or
+ * incrementing the refcount of entry in the swap
+ * memory.
+ *
+ * @param new new page table
+ * @param old old page table
+ * @return int error if any
+ */
+int pt_copy(struct page_table *new, struct page_table *old)
+{
+    struct hpt_entry *old_entry, *new_entry;
+    struct page *page;
+
+    KASSERT(new->total_pages == 0);
+    KASSERT(new->swap_pages == 0);
+
+    list_for_each_entry(old_entry, &old->entries, pt_link) {
+        if (pte_none(old_entry->pte))
+            continue;
+
+        new_entry = hpt_insert(new, old_entry->vaddr);
+        if (!new_entry)
+            return ENOMEM;
+
+        if (pte_swap(old_entry->pte)) {
+            swap_inc_page(pte_swap_entry(old_entry->pte));
+            new_entry->pte = old_entry->pte;
+            new->swap_pages += 1;
+            continue;
+        }
+
+        KASSERT(pte_present(old_entry->pte));
+
+        page = pte_page(old_entry->pte);
+        user_page_get(page);
+        pte_set_cow(&old_entry->pte);
+
+        /* copy the flags */
+        pte_set_page(&new_entry->pte, page_to_kvaddr(page), pte_flags(old_entry->pte));
+
+        new->total_pages += 1;
+    }
+
+    KASSERT(new->total_pages == old->total_pages);
+    KASSERT(new->swap_pages == old->swap_pages);
+
+    return 0;
+}
+
+/**
+ * @brief Prints the occupancy of the hashed page table.
+ *
+ */
+void hpt_print_info(void)
+{
+    struct hpt_entry *entry;
+    unsigned bkt, used = 0, chain, longest = 0;
+
+    spinlock_acquire(&hpt_lock);
+
+    for (bkt = 0; bkt < HASH_SIZE(hpt_table); bkt++) {
+        chain = 0;
+        hlist_for_each_entry(entry, &hpt_table[bkt], hash_link) {
+            chain += 1;
+        }
+
+        used += chain > 0;
+        if (chain > longest)
+            longest = chain;
+    }
+
+    kprintf("Hashed page table info:\n");
+    kprintf("entries:\t\t%8u\n", hpt_nr_entries);
+    kprintf("entry size:\t\t%8u\n", hpt_entry_cache.size);
+    kprintf("buckets used:\t\t%8u/%u\n", used, HASH_SIZE(hpt_table));
+    kprintf("longest chain:\t\t%8u\n", longest);
+
+    spinlock_release(&hpt_lock);
+}
+
+#endif // OPT_HASHPT
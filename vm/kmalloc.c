@@ -31,6 +31,9 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -242,7 +245,10 @@ allocpagerefpage(struct kheap_root *root)
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(va);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
+		/*
+		 * It's only freed by kheap_shrink when no pageref is
+		 * in use, and we hold one.
+		 */
 		KASSERT(root->page != NULL);
 		return;
 	}
@@ -345,6 +351,61 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Block type of each heap page plus one, indexed by physical page
+ * number, 0 if the page does not hold subpage blocks. Updated under
+ * kmalloc_spinlock; it can be read without it by the owner of a
+ * block, as the page cannot be released while the block is in use.
+ */
+#define KHEAP_MAXPAGES TOTAL_PAGEREFS
+
+static uint8_t kheap_blocktypes[KHEAP_MAXPAGES];
+
+static
+inline
+void
+kheap_setblocktype(vaddr_t prpage, int blktype)
+{
+	size_t pfn = kvaddr_to_pfn(prpage);
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (pfn < KHEAP_MAXPAGES) {
+		kheap_blocktypes[pfn] = blktype + 1;
+	}
+}
+
+static
+inline
+void
+kheap_clearblocktype(vaddr_t prpage)
+{
+	size_t pfn = kvaddr_to_pfn(prpage);
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (pfn < KHEAP_MAXPAGES) {
+		kheap_blocktypes[pfn] = 0;
+	}
+}
+
+/*
+ * Return the block type of the page holding BLOCKADDR, or -1 if it
+ * is not known to be a subpage heap page.
+ */
+static
+inline
+int
+kheap_getblocktype(vaddr_t blockaddr)
+{
+	size_t pfn = kvaddr_to_pfn(blockaddr & PAGE_FRAME);
+
+	if (pfn >= KHEAP_MAXPAGES) {
+		return -1;
+	}
+	return (int)kheap_blocktypes[pfn] - 1;
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -794,6 +855,8 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kheap_printoccupancy(void);
+
 /*
  * Print the whole heap.
  */
@@ -802,6 +865,8 @@ kheap_printstats(void)
 {
 	struct pageref *pr;
 
+	kheap_printoccupancy();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -988,6 +1053,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	kheap_setblocktype(prpage, blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1018,23 +1084,14 @@ subpage_kmalloc(size_t sz
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Convert a pointer returned by subpage_kmalloc to the address of
+ * its block. Returns 0 if the pointer cannot be one of ours.
  */
 static
-int
-subpage_kfree(void *ptr)
+vaddr_t
+subpage_blockaddr(void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1049,21 +1106,45 @@ subpage_kfree(void *ptr)
 		 * a page we *do* own, and then we'll panic because
 		 * it's not a valid one.
 		 */
-		return -1;
+		return 0;
 	}
 	ptraddr -= GUARD_PTROFFSET;
 #endif
 #ifdef LABELS
 	if (ptraddr % PAGE_SIZE == 0) {
 		/* ditto */
-		return -1;
+		return 0;
 	}
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
+	return ptraddr;
+}
 
-	checksubpages();
+/*
+ * Put the block at PTRADDR back on the freelist of its page. If the
+ * block is not on any heap page we recognize, return -1. If the
+ * whole page becomes free it is removed from the lists and handed
+ * back in FREEPAGE, the caller must release it with free_kpages
+ * after dropping kmalloc_spinlock; otherwise FREEPAGE is set to 0.
+ */
+static
+int
+subpage_freeblock(vaddr_t ptraddr, void *ptr, vaddr_t *freepage)
+{
+	int blktype;		// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	*freepage = 0;
 
 	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
 	prpage = 0;
@@ -1085,7 +1166,6 @@ subpage_kfree(void *ptr)
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
@@ -1142,12 +1222,45 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		kheap_clearblocktype(prpage);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// address of the block
+	vaddr_t freepage;	// page to release, if any
+	int result;
+
+	ptraddr = subpage_blockaddr(ptr);
+	if (ptraddr == 0) {
+		return -1;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	result = subpage_freeblock(ptraddr, ptr, &freepage);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+
+	if (result) {
+		return result;
+	}
+
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1159,6 +1272,415 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+//    Every CPU keeps, for each block size, a small stack of free
+//    blocks (a magazine). kmalloc and kfree work on the magazine of
+//    the current CPU, under a lock of its own that is only contended
+//    when a thread migrates in the middle of the operation, and go to
+//    the shared pages under kmalloc_spinlock only to refill or flush
+//    MAGAZINE_BATCH blocks at once.
+//
+//    As far as the pages are concerned, a block in a magazine is
+//    allocated: it is not on the page freelist, it keeps a valid guard
+//    band, and it's filled with deadbeef only when flushed back.
+//
+//    Lock ordering: mag_lock before kmalloc_spinlock.
+//
+
+#define MAGAZINE_SIZE  16
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+struct magazine {
+	struct spinlock mag_lock;
+	unsigned nblocks;
+	vaddr_t blocks[MAGAZINE_SIZE];
+};
+
+static struct magazine magazines[MAXCPUS][NSIZES] = {
+	[0 ... MAXCPUS - 1] = {
+		[0 ... NSIZES - 1] = {
+			.mag_lock = SPINLOCK_INITIALIZER,
+			.nblocks = 0,
+		},
+	},
+};
+
+/*
+ * Get the magazine of the current cpu for BLKTYPE, NULL if the cpu
+ * structures are not set up yet.
+ */
+static
+struct magazine *
+magazine_get(int blktype)
+{
+	KASSERT(blktype >= 0 && blktype < NSIZES);
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &magazines[curcpu->c_number][blktype];
+}
+
+/*
+ * Move up to MAGAZINE_BATCH free blocks from the pages of BLKTYPE to
+ * the magazine. No new page is allocated here: if there are no free
+ * blocks the caller falls back to subpage_kmalloc.
+ */
+static
+void
+magazine_refill(struct magazine *mag, int blktype)
+{
+	struct pageref *pr;
+	vaddr_t prpage, fla;
+	struct freelist *fl;
+
+	KASSERT(spinlock_do_i_hold(&mag->mag_lock));
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (pr = sizebases[blktype];
+	     pr != NULL && mag->nblocks < MAGAZINE_BATCH;
+	     pr = pr->next_samesize) {
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		prpage = PR_PAGEADDR(pr);
+
+		while (pr->nfree > 0 && mag->nblocks < MAGAZINE_BATCH) {
+			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			fla = prpage + pr->freelist_offset;
+			fl = (struct freelist *)fla;
+
+			pr->nfree--;
+			if (fl->next != NULL) {
+				KASSERT(pr->nfree > 0);
+				KASSERT((vaddr_t)fl->next - prpage < PAGE_SIZE);
+				pr->freelist_offset = (vaddr_t)fl->next - prpage;
+			}
+			else {
+				KASSERT(pr->nfree == 0);
+				pr->freelist_offset = INVALID_OFFSET;
+			}
+#ifdef GUARDS
+			/* The block is no longer free, give it a guard band. */
+			establishguardband(fl, sizes[blktype] - GUARD_OVERHEAD,
+					   sizes[blktype]);
+#endif
+			mag->blocks[mag->nblocks++] = fla;
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Give NBLOCKS blocks of the magazine back to their pages, releasing
+ * the pages that become completely free. Returns the number of pages
+ * released.
+ */
+static
+unsigned
+magazine_flush(struct magazine *mag, unsigned nblocks)
+{
+	vaddr_t freepages[MAGAZINE_SIZE];
+	unsigned i, nfreepages = 0;
+	vaddr_t block, freepage;
+
+	KASSERT(spinlock_do_i_hold(&mag->mag_lock));
+	KASSERT(nblocks <= mag->nblocks);
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (i=0; i<nblocks; i++) {
+		block = mag->blocks[--mag->nblocks];
+		if (subpage_freeblock(block, (void *)block, &freepage)) {
+			panic("kfree: magazine block %p is not on a heap page\n",
+			      (void *)block);
+		}
+		if (freepage != 0) {
+			freepages[nfreepages++] = freepage;
+		}
+	}
+
+	checksubpages();
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+
+	return nfreepages;
+}
+
+/*
+ * Allocate a block of size SZ from the magazine of the current cpu.
+ * Returns NULL if no free block is available without allocating a
+ * new page.
+ */
+static
+void *
+magazine_kmalloc(size_t sz
+#ifdef LABELS
+		 , vaddr_t label
+#endif
+	)
+{
+	struct magazine *mag;
+	unsigned blktype;
+	vaddr_t block;
+	void *retptr;
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	mag = magazine_get(blktype);
+	if (mag == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&mag->mag_lock);
+
+	if (mag->nblocks == 0) {
+		magazine_refill(mag, blktype);
+	}
+
+	if (mag->nblocks == 0) {
+		spinlock_release(&mag->mag_lock);
+		return NULL;
+	}
+
+	block = mag->blocks[--mag->nblocks];
+
+	spinlock_release(&mag->mag_lock);
+
+	retptr = (void *)block;
+
+#ifdef CHECKGUARDS
+	/* checksubpages reads the guard bands under kmalloc_spinlock */
+	spinlock_acquire(&kmalloc_spinlock);
+#endif
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef CHECKGUARDS
+	spinlock_release(&kmalloc_spinlock);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	return retptr;
+}
+
+/*
+ * Free a pointer previously returned from kmalloc to the magazine of
+ * the current cpu. If the pointer is not on any heap page we
+ * recognize, return -1.
+ */
+static
+int
+magazine_kfree(void *ptr)
+{
+	struct magazine *mag;
+	vaddr_t block;
+	int blktype;
+#ifdef GUARDS
+	size_t smallerblocksize;
+#endif
+
+	block = subpage_blockaddr(ptr);
+	if (block == 0) {
+		return -1;
+	}
+
+	blktype = kheap_getblocktype(block);
+	if (blktype < 0) {
+		return -1;
+	}
+
+	/* Check for proper positioning and alignment */
+	if ((block & ~PAGE_FRAME) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+#ifdef GUARDS
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(block, smallerblocksize, sizes[blktype]);
+#endif
+
+	mag = magazine_get(blktype);
+	if (mag == NULL) {
+		return -1;
+	}
+
+	spinlock_acquire(&mag->mag_lock);
+
+	if (mag->nblocks == MAGAZINE_SIZE) {
+		magazine_flush(mag, MAGAZINE_BATCH);
+	}
+
+	mag->blocks[mag->nblocks++] = block;
+
+	spinlock_release(&mag->mag_lock);
+
+	return 0;
+}
+
+////////////////////////////////////////
+//
+// Shrinker.
+//
+//    Called by the page allocator when it runs out of memory. The
+//    subpage pages can't be released as long as one of their blocks
+//    sits in a magazine, so every magazine of every cpu is flushed
+//    back; the pages that become free go back to the page allocator,
+//    together with the pageref pages that no longer track any page.
+//
+
+/*
+ * Release the pageref pages without pagerefs in use. Returns the
+ * number of pages released.
+ */
+static
+unsigned
+kheap_shrink_pagerefpages(void)
+{
+	struct pagerefpage *freepages[NUM_PAGEREFPAGES];
+	unsigned i, nfreepages = 0;
+	struct kheap_root *root;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	for (i=0; i<NUM_PAGEREFPAGES; i++) {
+		root = &kheaproots[i];
+		if (root->page != NULL && root->numinuse == 0) {
+			freepages[nfreepages++] = root->page;
+			root->page = NULL;
+		}
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages((vaddr_t)freepages[i]);
+	}
+
+	return nfreepages;
+}
+
+/*
+ * Give back to the page allocator all the kernel heap pages that are
+ * not in use. Returns the number of pages released.
+ */
+unsigned
+kheap_shrink(void)
+{
+	struct magazine *mag;
+	unsigned cpu, i, nfreed = 0;
+
+	for (cpu=0; cpu<MAXCPUS; cpu++) {
+		for (i=0; i<NSIZES; i++) {
+			mag = &magazines[cpu][i];
+
+			spinlock_acquire(&mag->mag_lock);
+			if (mag->nblocks > 0) {
+				nfreed += magazine_flush(mag, mag->nblocks);
+			}
+			spinlock_release(&mag->mag_lock);
+		}
+	}
+
+	nfreed += kheap_shrink_pagerefpages();
+
+	return nfreed;
+}
+
+/*
+ * Print how many pages and blocks each size class is using. Blocks
+ * in the magazines are free for the clients but not for the pages.
+ */
+static
+void
+kheap_printoccupancy(void)
+{
+	unsigned magblocks[NSIZES], npages[NSIZES], nfree[NSIZES];
+	unsigned cpu, i, nblocks, nused;
+	struct pageref *pr;
+	int blktype;
+
+	for (i=0; i<NSIZES; i++) {
+		magblocks[i] = 0;
+		for (cpu=0; cpu<MAXCPUS; cpu++) {
+			spinlock_acquire(&magazines[cpu][i].mag_lock);
+			magblocks[i] += magazines[cpu][i].nblocks;
+			spinlock_release(&magazines[cpu][i].mag_lock);
+		}
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	for (i=0; i<NSIZES; i++) {
+		npages[i] = 0;
+		nfree[i] = 0;
+	}
+
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		blktype = PR_BLOCKTYPE(pr);
+		KASSERT(blktype >= 0 && blktype < NSIZES);
+		npages[blktype]++;
+		nfree[blktype] += pr->nfree;
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("Subpage allocator occupancy:\n");
+	kprintf("%8s %8s %8s %8s %8s %8s\n",
+		"size", "pages", "blocks", "used", "free", "magazine");
+
+	for (i=0; i<NSIZES; i++) {
+		nblocks = npages[i] * (PAGE_SIZE / sizes[i]);
+		/* the magazines are read before the pages, don't underflow */
+		nused = nblocks - nfree[i];
+		nused = nused > magblocks[i] ? nused - magblocks[i] : 0;
+
+		kprintf("%8lu %8u %8u %8u %8u %8u\n",
+			(unsigned long)sizes[i], npages[i], nblocks,
+			nused, nfree[i], magblocks[i]);
+	}
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1170,6 +1692,7 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	void *retptr;
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1198,6 +1721,15 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef LABELS
+	retptr = magazine_kmalloc(sz, label);
+#else
+	retptr = magazine_kmalloc(sz);
+#endif
+	if (retptr != NULL) {
+		return retptr;
+	}
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1212,10 +1744,13 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try the magazine and then subpage; if that fails, assume it's
+	 * a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
+	} else if (magazine_kfree(ptr) == 0) {
+		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
@@ -0,0 +1,324 @@
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <container_of.h>
+#include <hashtable.h>
+#include <page.h>
+#include <pt.h>
+#include <vm.h>
+#include <vm_tlb.h>
+#include <slab.h>
+#include <rwonce.h>
+#include <ksm.h>
+
+
+/*
+ * Seconds between two scans of the address spaces.
+ */
+#define KSM_SCAN_INTERVAL   (2)
+
+/*
+ * Pages scanned before giving up the cpu.
+ */
+#define KSM_SCAN_BATCH      (32)
+
+/**
+ * @brief A page already scanned during the current pass. The
+ * scanner holds no reference to it, the page can be changed or
+ * freed in the meantime: before merging, its mapping is looked
+ * up again and the content compared once write protected.
+ *
+ */
+struct ksm_item {
+    struct hlist_node link;     /* entry in ksm_table */
+    uint32_t checksum;          /* checksum of the page content */
+    size_t pfn;                 /* candidate page */
+    unsigned as_id;             /* address space mapping the page */
+    vaddr_t addr;               /* address the page is mapped at */
+};
+
+/*
+ * Candidate pages of the current pass, hashed by checksum.
+ * Only ksmd uses it.
+ */
+static DEFINE_HASHTABLE(ksm_table, 8);
+
+static DEFINE_KMEM_CACHE(ksm_item_cache, struct ksm_item, NULL);
+
+/*
+ * Statistics.
+ */
+static unsigned ksm_full_scans = 0;
+static unsigned ksm_pages_merged = 0;
+
+struct ksm_scan {
+    struct as_cursor cursor;    /* where the pass resumes from */
+    unsigned nr_scanned;        /* pages scanned since the last yield */
+};
+
+/*
+ * Candidate page being write protected in its
+ * address space, see ksm_protect_pte().
+ */
+struct ksm_protect {
+    struct page *page;          /* page expected in the mapping */
+    bool found;                 /* still mapped, a reference was taken */
+};
+
+/**
+ * @brief FNV-1a hash of the content of a page.
+ *
+ * @param page user page
+ * @return uint32_t
+ */
+static uint32_t ksm_checksum(struct page *page)
+{
+    const uint32_t *data = (const uint32_t *)page_to_kvaddr(page);
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static bool ksm_same_page(struct page *a, struct page *b)
+{
+    const uint32_t *data_a = (const uint32_t *)page_to_kvaddr(a);
+    const uint32_t *data_b = (const uint32_t *)page_to_kvaddr(b);
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (data_a[i] != data_b[i])
+            return false;
+    }
+
+    return true;
+}
+
+static void ksm_insert(struct page *page, uint32_t checksum, struct addrspace *as, vaddr_t page_addr)
+{
+    struct ksm_item *item;
+
+    item = kmem_cache_alloc(&ksm_item_cache);
+    if (!item)
+        return;
+
+    item->checksum = checksum;
+    item->pfn = page_to_pfn(page);
+    item->as_id = as->as_id;
+    item->addr = page_addr;
+    hash_add(ksm_table, &item->link, checksum);
+}
+
+/**
+ * @brief Drop all the candidates at the end of a pass.
+ *
+ */
+static void ksm_release_items(void)
+{
+    struct ksm_item *item;
+    struct hlist_node *tmp;
+    unsigned bkt;
+
+    hash_for_each_safe(ksm_table, bkt, tmp, item, link) {
+        hash_del(&item->link);
+        kmem_cache_free(&ksm_item_cache, item);
+    }
+}
+
+/**
+ * @brief Make the mapping of `page_addr` readonly, a write
+ * will go through the COW path of `readonly_fault`.
+ *
+ */
+static void ksm_write_protect(struct addrspace *as, pte_t *pte, vaddr_t page_addr)
+{
+    struct addrspace_area *area;
+
+    area = as_find_area(as, page_addr);
+    KASSERT(area != NULL);
+
+    /* set AS_AREA_MAY_WRITE for COW mapping */
+    area->area_flags |= asa_write(area) * AS_AREA_MAY_WRITE;
+
+    if (!pte_write(*pte))
+        return;
+
+    pte_set_cow(pte);
+    vm_tlb_shootdown(page_addr);
+}
+
+/**
+ * @brief Write protect the candidate if it is still mapped where
+ * it was found, and take a reference to it while its page table
+ * is locked: from now on a write from its owner copies the page.
+ *
+ */
+static walk_action_t ksm_protect_pte(struct page_table *pt, pte_t *pte, vaddr_t page_addr, void *private)
+{
+    struct ksm_protect *protect = private;
+    struct addrspace *as = container_of(pt, struct addrspace, pt);
+
+    if (!pte_present(*pte) || pte_swap(*pte) || pte_page(*pte) != protect->page)
+        return WALK_BREAK;
+
+    ksm_write_protect(as, pte, page_addr);
+    user_page_get(protect->page);
+    protect->found = true;
+
+    return WALK_BREAK;
+}
+
+/**
+ * @brief Map the candidate `item` in place of the page
+ * mapped by `pte`, if they still have the same content.
+ *
+ * @return true if the pages were merged
+ */
+static bool ksm_merge(struct addrspace *as, pte_t *pte, vaddr_t page_addr, struct ksm_item *item)
+{
+    struct page *page = pte_page(*pte);
+    struct ksm_protect protect;
+    pteflags_t flags;
+    int retval;
+
+    protect.page = pfn_to_page(item->pfn);
+    protect.found = false;
+
+    /* already merged */
+    if (protect.page == page)
+        return false;
+
+    retval = as_walk_one(item->as_id, item->addr, item->addr + PAGE_SIZE, ksm_protect_pte, &protect);
+    if (retval || !protect.found)
+        return false;
+
+    /* the content must not change while it is compared */
+    ksm_write_protect(as, pte, page_addr);
+
+    if (!ksm_same_page(protect.page, page)) {
+        user_page_put(protect.page);
+        return false;
+    }
+
+    /* map the candidate readonly in place of `page` */
+    flags = pte_flags(*pte);
+
+    pte_clear(pte);
+    pte_set_page(pte, page_to_kvaddr(protect.page), flags);
+    vm_tlb_shootdown(page_addr);
+
+    user_page_put(page);
+    ksm_pages_merged += 1;
+
+    return true;
+}
+
+static walk_action_t ksm_scan_pte(struct page_table *pt, pte_t *pte, vaddr_t page_addr, void *private)
+{
+    struct ksm_scan *scan = private;
+    struct addrspace *as = container_of(pt, struct addrspace, pt);
+    struct ksm_item *item;
+    struct page *page;
+    uint32_t checksum;
+    bool found = false;
+
+    if (!pte_present(*pte) || pte_swap(*pte))
+        goto next;
+
+    page = pte_page(*pte);
+    if (page->flags != PGF_USER)
+        goto next;
+
+    checksum = ksm_checksum(page);
+
+    hash_for_each_possible(ksm_table, item, link, checksum) {
+        if (item->checksum != checksum)
+            continue;
+
+        found = true;
+        if (ksm_merge(as, pte, page_addr, item))
+            break;
+    }
+
+    if (!found)
+        ksm_insert(page, checksum, as, page_addr);
+
+next:
+    if (++scan->nr_scanned < KSM_SCAN_BATCH)
+        return WALK_CONTINUE;
+
+    /* give up the cpu once the locks are released */
+    scan->nr_scanned = 0;
+    scan->cursor.as_id = as->as_id;
+    scan->cursor.addr = page_addr + PAGE_SIZE;
+    scan->cursor.stopped = true;
+
+    return WALK_BREAK;
+}
+
+static void ksm_thread(void *ign, unsigned long ign2)
+{
+    struct ksm_scan scan;
+
+    (void)ign;
+    (void)ign2;
+
+    for (;;) {
+        clocksleep(KSM_SCAN_INTERVAL);
+
+        scan.cursor.as_id = 0;
+        scan.cursor.addr = 0;
+        scan.nr_scanned = 0;
+
+        while (as_walk_resume(&scan.cursor, ksm_scan_pte, &scan) == 0) {
+            if (!scan.cursor.stopped) {
+                ksm_full_scans += 1;
+                break;
+            }
+
+            thread_yield();
+        }
+
+        ksm_release_items();
+    }
+}
+
+/**
+ * @brief Starts the kernel thread that merges the
+ * user pages with the same content.
+ *
+ */
+void ksm_bootstrap(void)
+{
+    int retval;
+
+    retval = thread_fork("ksmd", NULL, ksm_thread, NULL, 0);
+    if (retval)
+        panic("ksm_bootstrap: could not start ksmd: %s\n", strerror(retval));
+}
+
+/**
+ * @brief Prints the user pages shared among more than
+ * one mapping and the memory saved.
+ *
+ */
+void ksm_print_info(void)
+{
+    size_t shared, sharing;
+
+    user_pages_shared(&shared, &sharing);
+
+    kprintf("Same page merging info:\n");
+    kprintf("full scans:\t\t%8u\n", ksm_full_scans);
+    kprintf("pages merged:\t\t%8u\n", ksm_pages_merged);
+    kprintf("pages shared:\t\t%8u\n", shared);
+    kprintf("bytes saved:\t\t%8u\n", sharing * PAGE_SIZE);
+}
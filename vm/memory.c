@@ -7,6 +7,7 @@
 #include <page.h>
 #include <fault_stat.h>
 #include <swap.h>
+#include <synch.h>
 #include <kern/errno.h>
 
 static inline bool is_cow_mapping(area_flags_t flags)
@@ -36,6 +37,7 @@ static int page_not_present_fault(
 	int fault_type)
 {
 	struct page *page;
+	bool populated = !pte_none(*pte);
 	int retval;
 
 	page = alloc_user_page();
@@ -48,6 +50,8 @@ static int page_not_present_fault(
 		if (retval)
 			goto cleanup_page;
 
+		pt_inc_swap_count(&as->pt, -1);
+
 		fstat_page_faults_swap();
 	}
 	/* load page from memory if file mapped */
@@ -59,6 +63,12 @@ static int page_not_present_fault(
 			goto cleanup_page;
 
 		fstat_page_faults_elf();
+	}
+	/* stack of a thread, zero-filled on the first touch */
+	else if (pte_none(*pte) && area->area_type == ASA_TYPE_STACK) {
+		clear_page(page);
+
+		fstat_page_faults_zero();
 	} else {
 		panic("Don't know what kind of pte faulted!\n");
 	}
@@ -74,6 +84,8 @@ static int page_not_present_fault(
 
 	pte_clear(pte);
 	pte_set_page(pte, page_to_kvaddr(page), flags);
+	if (!populated)
+		pt_pte_populated(pte);
 	pt_inc_page_count(&as->pt, 1);
 
 	fstat_page_faults_disk();
@@ -111,7 +123,7 @@ static int readonly_fault(
 	vaddr_t fault_address,
 	int fault_type)
 {
-	struct page *page;
+	struct page *page, *old_page;
 
 	// TODO: temp
 	(void)as;
@@ -120,7 +132,7 @@ static int readonly_fault(
 	if (asa_readonly(area))
 		return EFAULT;
 
-	page = pte_page(*pte);
+	page = old_page = pte_page(*pte);
 
 	/*
 	 * Clear the entry from the pte before checking
@@ -136,13 +148,18 @@ static int readonly_fault(
 	}
 
 	if (!page) {
+		pt_clear_pte(&as->pt, fault_address);
 		pt_inc_page_count(&as->pt, -1);
-		vm_tlb_flush_one(fault_address);
+		vm_tlb_invalidate(fault_address);
 		return ENOMEM;
 	}
 
 	pte_set_page(pte, page_to_kvaddr(page), PAGE_PRESENT | PAGE_RW | PAGE_ACCESSED | PAGE_DIRTY);
 
+	/* the other threads could still read the old copy */
+	if (page != old_page)
+		vm_tlb_invalidate(fault_address);
+
 	vm_tlb_set_page(fault_address, page_to_paddr(page), true);
 	fstat_tlb_realoads();
 
@@ -161,6 +178,7 @@ static int vm_handle_fault(struct addrspace *as, vaddr_t fault_address, int faul
 {
 	struct addrspace_area *area;
 	pte_t *pte, pte_entry;
+	int retval;
 
 	area = as_find_area(as, fault_address);
 	if (!area)
@@ -173,7 +191,13 @@ static int vm_handle_fault(struct addrspace *as, vaddr_t fault_address, int faul
 	pte_entry = *pte;
 
 	if (!pte_present(pte_entry)) {
-		return page_not_present_fault(as, area, pte, fault_address, fault_type);
+		as->nr_faults += 1;
+
+		retval = page_not_present_fault(as, area, pte, fault_address, fault_type);
+		/* don't leave behind a table allocated for nothing */
+		if (retval)
+			pt_free_empty_pte(&as->pt, fault_address);
+		return retval;
 	}
 
 	/* The page is not present in memory */
@@ -181,6 +205,9 @@ static int vm_handle_fault(struct addrspace *as, vaddr_t fault_address, int faul
 		return readonly_fault(as, area, pte, fault_address, fault_type);
 	}
 
+	/* the reference bit is kept by software, see the working set sampler */
+	pte_set_flags(pte, PAGE_ACCESSED);
+
 	vm_tlb_set_page(fault_address, pte_paddr(pte_entry), pte_write(pte_entry));
 	fstat_tlb_realoads();
 
@@ -220,7 +247,9 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 	if (faultaddress == 0)
 		return EFAULT;
 
+	lock_acquire(as->pt_lock);
     retval = vm_handle_fault(as, faultaddress, faulttype);
+	lock_release(as->pt_lock);
     if (retval)
         return retval;
 
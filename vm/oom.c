@@ -0,0 +1,194 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <proc.h>
+#include <current.h>
+#include <rwonce.h>
+#include <addrspace.h>
+#include <kern/errno.h>
+#include <oom.h>
+
+
+/*
+ * Seconds an allocation waits for the victim to
+ * release its memory before giving up.
+ */
+#define OOM_WAIT_SECS (2)
+
+/*
+ * The allocations waiting for a victim sleep on `oom_wchan`,
+ * they are woken up when an address space is destroyed and
+ * once a second. Both counters are protected by `oom_lock`.
+ */
+static struct wchan *oom_wchan = NULL;
+static struct spinlock oom_lock = SPINLOCK_INITIALIZER;
+static unsigned oom_released = 0;   /* address spaces destroyed */
+static unsigned oom_seconds = 0;    /* seconds elapsed */
+
+/*
+ * Result of the scan of the processes.
+ */
+struct oom_control {
+    pid_t victim;               /* pid of the chosen process, -1 if none */
+    size_t victim_points;       /* badness of the chosen process */
+    bool pending;               /* a previous victim still holds its memory */
+};
+
+/**
+ * @brief Badness of a process, the number of pages it is
+ * using both in memory and in the swap memory.
+ * 
+ * @param as address space of the process
+ * @return size_t 
+ */
+static inline size_t oom_badness(struct addrspace *as)
+{
+    return as->pt.total_pages + as->pt.swap_pages;
+}
+
+static void oom_evaluate_proc(struct proc *proc, void *private)
+{
+    struct oom_control *oc = private;
+    size_t points;
+
+    spinlock_acquire(&proc->p_lock);
+
+    /* kernel procs and exited procs own no user memory */
+    if (proc->p_addrspace == NULL) {
+        spinlock_release(&proc->p_lock);
+        return;
+    }
+
+    if (proc->p_killed) {
+        oc->pending = true;
+        spinlock_release(&proc->p_lock);
+        return;
+    }
+
+    /*
+     * The address space is released by `_exit()`
+     * after setting p_addrspace to NULL, holding
+     * p_lock it can't go away.
+     */
+    points = oom_badness(proc->p_addrspace);
+
+    spinlock_release(&proc->p_lock);
+
+    if (points > oc->victim_points) {
+        oc->victim = proc->pid;
+        oc->victim_points = points;
+    }
+}
+
+/**
+ * @brief Sleeps until an address space is destroyed after
+ * `released` were, for OOM_WAIT_SECS seconds at most.
+ * 
+ * @param released value of `oom_released` before the kill
+ */
+static void oom_wait(unsigned released)
+{
+    unsigned start;
+
+    /* killed itself, the memory is released when it exits */
+    if (oom_wchan == NULL || READ_ONCE(curproc->p_killed))
+        return;
+
+    spinlock_acquire(&oom_lock);
+
+    start = oom_seconds;
+    while (oom_released == released && oom_seconds - start < OOM_WAIT_SECS)
+        wchan_sleep(oom_wchan, &oom_lock);
+
+    spinlock_release(&oom_lock);
+}
+
+/**
+ * @brief Out of memory and out of swap memory, choose the
+ * process with most resident and swapped pages and kill it,
+ * its frames and swap entries are released when it exits.
+ * Only one victim at a time is killed, the caller sleeps
+ * until the victim, new or pending, is gone.
+ * 
+ * @return int ENOMEM if there is no process to kill
+ */
+int oom_kill_process(void)
+{
+    struct oom_control oc = {
+        .victim = -1,
+        .victim_points = 0,
+        .pending = false,
+    };
+    unsigned released;
+
+    spinlock_acquire(&oom_lock);
+    released = oom_released;
+    spinlock_release(&oom_lock);
+
+    proc_for_each_process(oom_evaluate_proc, &oc);
+
+    /* wait for the previous victim to exit */
+    if (oc.pending) {
+        oom_wait(released);
+        return 0;
+    }
+
+    if (oc.victim == -1)
+        return ENOMEM;
+
+    /* the victim may have exited in the meantime */
+    if (proc_kill(oc.victim))
+        return 0;
+
+    kprintf("Out of memory: killed process %d, %u pages\n",
+            oc.victim, oc.victim_points);
+
+    oom_wait(released);
+
+    return 0;
+}
+
+/**
+ * @brief Wakes up the allocations waiting for a victim,
+ * called when an address space is destroyed.
+ * 
+ */
+void oom_wakeup(void)
+{
+    if (oom_wchan == NULL)
+        return;
+
+    spinlock_acquire(&oom_lock);
+    oom_released += 1;
+    wchan_wakeall(oom_wchan, &oom_lock);
+    spinlock_release(&oom_lock);
+}
+
+/**
+ * @brief Called once a second by the timer, it bounds
+ * the wait of the allocations.
+ * 
+ */
+void oom_timerclock(void)
+{
+    if (oom_wchan == NULL)
+        return;
+
+    spinlock_acquire(&oom_lock);
+    oom_seconds += 1;
+    wchan_wakeall(oom_wchan, &oom_lock);
+    spinlock_release(&oom_lock);
+}
+
+void oom_bootstrap(void)
+{
+    struct wchan *wchan;
+
+    wchan = wchan_create("oom");
+    if (!wchan)
+        panic("oom_bootstrap: could not create the wchan\n");
+
+    /* publish the wchan last, the timer checks it */
+    WRITE_ONCE(oom_wchan, wchan);
+}
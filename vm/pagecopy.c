@@ -0,0 +1,78 @@
+#include <types.h>
+#include <compiler_types.h>
+#include <lib.h>
+#include <vm.h>
+
+
+/*
+ * Words moved by one iteration of the loops, a whole
+ * page is always a multiple of it.
+ */
+#define PAGE_WORDS_PER_ITER (8)
+
+/**
+ * @brief Copies a page frame, both the addresses must be
+ * page aligned. Loads are grouped before the stores so the
+ * load delay slots are filled by the next loads.
+ * 
+ * @param dst kernel virtual address of the destination page
+ * @param src kernel virtual address of the source page
+ */
+void kpage_copy(void *dst, const void *src)
+{
+    uint32_t *d = dst;
+    const uint32_t *s = src;
+    const uint32_t *end = s + PAGE_SIZE / sizeof(uint32_t);
+    uint32_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+    KASSERT(((vaddr_t)dst & PAGE_FRAME) == (vaddr_t)dst);
+    KASSERT(((vaddr_t)src & PAGE_FRAME) == (vaddr_t)src);
+
+    compiletime_assert(PAGE_SIZE % (PAGE_WORDS_PER_ITER * sizeof(uint32_t)) == 0,
+            "PAGE_SIZE must be a multiple of the unrolled copy");
+
+    for (; s < end; s += PAGE_WORDS_PER_ITER, d += PAGE_WORDS_PER_ITER) {
+        t0 = s[0];
+        t1 = s[1];
+        t2 = s[2];
+        t3 = s[3];
+        t4 = s[4];
+        t5 = s[5];
+        t6 = s[6];
+        t7 = s[7];
+
+        d[0] = t0;
+        d[1] = t1;
+        d[2] = t2;
+        d[3] = t3;
+        d[4] = t4;
+        d[5] = t5;
+        d[6] = t6;
+        d[7] = t7;
+    }
+}
+
+/**
+ * @brief Fills a page frame with zeros, the address
+ * must be page aligned.
+ * 
+ * @param dst kernel virtual address of the page
+ */
+void kpage_zero(void *dst)
+{
+    uint32_t *d = dst;
+    uint32_t *end = d + PAGE_SIZE / sizeof(uint32_t);
+
+    KASSERT(((vaddr_t)dst & PAGE_FRAME) == (vaddr_t)dst);
+
+    for (; d < end; d += PAGE_WORDS_PER_ITER) {
+        d[0] = 0;
+        d[1] = 0;
+        d[2] = 0;
+        d[3] = 0;
+        d[4] = 0;
+        d[5] = 0;
+        d[6] = 0;
+        d[7] = 0;
+    }
+}
@@ -5,6 +5,10 @@
 #include <addrspace.h>
 #include <page.h>
 #include <swap.h>
+#include "opt-hashpt.h"
+
+/* the hashed page table replaces this file, see vm/hpt.c */
+#if !OPT_HASHPT
 
 
 static inline vaddr_t pmd_addr_end(vaddr_t addr, vaddr_t end)
@@ -52,6 +56,33 @@ static inline pmd_t *pmd_offset(struct page_table *pt, vaddr_t addr)
 }
 
 
+/**
+ * @brief Get the struct page holding a PTE table, it keeps
+ * the number of populated entries of the table.
+ * 
+ * @param pte PTE table or one of its entries
+ * @return struct page* 
+ */
+static inline struct page *pte_table_page(pte_t *pte)
+{
+    return kvaddr_to_page((vaddr_t)pte & PAGE_FRAME);
+}
+
+static inline unsigned pte_populated(pte_t *pte)
+{
+    return pte_table_page(pte)->pt_populated;
+}
+
+static inline void pte_inc_populated(pte_t *pte, int count)
+{
+    struct page *page = pte_table_page(pte);
+
+    KASSERT(count >= 0 || page->pt_populated >= (unsigned)-count);
+    KASSERT(page->pt_populated + count <= PTRS_PER_PTE);
+
+    page->pt_populated += count;
+}
+
 /**
  * @brief Creates a PTE and initialize all entry to invalid
  * 
@@ -72,46 +103,98 @@ static pte_t *pte_create_table(void)
 
     pte = (pte_t *)pte_address;
     pte_clean_table(pte);
+    pte_table_page(pte)->pt_populated = 0;
 
     return pte;
 }
 
+/*
+ * Swap entries collected by a teardown before
+ * they are released together.
+ */
+#define PT_FREE_SWAP_BATCH (64)
+
+/**
+ * @brief State of a page table teardown, the frames
+ * and swap entries released are gathered here and
+ * given back in batches.
+ * 
+ */
+struct pt_free_batch {
+    struct list_head pages;                 /* frames to give back to the buddy allocator */
+    swap_entry_t swap[PT_FREE_SWAP_BATCH];  /* swap entries to release */
+    size_t nr_swap;                         /* number of entries in `swap` */
+    size_t freed_pages;                     /* resident pages unmapped */
+    size_t freed_swap;                      /* swap entries unmapped */
+};
+
+static void pt_free_batch_flush_swap(struct pt_free_batch *batch)
+{
+    if (batch->nr_swap == 0)
+        return;
+
+    swap_dec_pages(batch->swap, batch->nr_swap);
+    batch->nr_swap = 0;
+}
+
+static void pt_free_batch_add_swap(struct pt_free_batch *batch, swap_entry_t entry)
+{
+    batch->swap[batch->nr_swap++] = entry;
+
+    if (batch->nr_swap == PT_FREE_SWAP_BATCH)
+        pt_free_batch_flush_swap(batch);
+}
+
 /**
- * @brief freed the pte and return the number of freed
- * pages
+ * @brief Releases everything gathered by the teardown.
+ * 
+ * @param batch 
+ */
+static void pt_free_batch_flush(struct pt_free_batch *batch)
+{
+    pt_free_batch_flush_swap(batch);
+    free_pages_list(&batch->pages);
+}
+
+/**
+ * @brief Unmaps all the entries of the pte, the freed
+ * frames, swap entries and the table itself are
+ * queued on `batch`.
  * 
  * @param pte 
- * @return number freed pages
+ * @param batch teardown state
  */
-static size_t pte_free_table(pte_t *pte)
+static void pte_free_table(pte_t *pte, struct pt_free_batch *batch)
 {
     struct page *page;
-    size_t freed_pages = 0;
     size_t i;
 
-    /* free pages */
-    for (i = 0; i < PTRS_PER_PTE; i++) {
+    /* free pages, stop at the last populated entry */
+    for (i = 0; i < PTRS_PER_PTE && pte_populated(pte) > 0; i++) {
         if (pte_none(pte[i]))
             continue;
 
+        pte_inc_populated(pte, -1);
+
         if (pte_swap(pte[i])) {
-            swap_dec_page(pte_swap_entry(pte[i]));
+            pt_free_batch_add_swap(batch, pte_swap_entry(pte[i]));
             pte_clear(&pte[i]);
+            batch->freed_swap += 1;
             continue;
         }
 
         KASSERT(pte_present(pte[i]));
 
         page = pte_page(pte[i]);
-        user_page_put(page);
+        user_page_put_deferred(page, &batch->pages);
 
         pte_clear(&pte[i]);
-        freed_pages += 1;
+        batch->freed_pages += 1;
     }
 
-    free_kpages((vaddr_t)pte);
+    KASSERT(pte_populated(pte) == 0);
 
-    return freed_pages;
+    list_add_tail(&pte_table_page(pte)->buddy_list, &batch->pages);
 }
 
 static int pte_alloc_page_range(pte_t *pte, vaddr_t start, vaddr_t end, struct pt_page_flags flags, size_t *alloc_pages)
@@ -148,6 +231,7 @@ static int pte_alloc_page_range(pte_t *pte, vaddr_t start, vaddr_t end, struct p
         *alloc_pages += 1;
 
         pte_set_page(pte_entry, page_to_kvaddr(page), page_flags);
+        pte_inc_populated(pte, 1);
     }
 
     return 0;
@@ -181,15 +265,14 @@ static pmd_t *pmd_create_table(void)
 }
 
 /**
- * @brief freed the pmd table and return the number of freed
- * pages
+ * @brief Unmaps the whole pmd table, the freed pages
+ * are queued on `batch`.
  * 
  * @param pmd table
- * @return size_t number of freed pages
+ * @param batch teardown state
  */
-static size_t pmd_free_table(pmd_t *pmd)
+static void pmd_free_table(pmd_t *pmd, struct pt_free_batch *batch)
 {
-    size_t freed_pages = 0;
     size_t i;
 
     KASSERT(pmd != NULL);
@@ -198,23 +281,21 @@ static size_t pmd_free_table(pmd_t *pmd)
         if (!pmd_present(pmd[i]))
             continue;
 
-        freed_pages += pte_free_table(pmd_ptetable(pmd[i]));
+        pte_free_table(pmd_ptetable(pmd[i]), batch);
         pmd_clear(&pmd[i]);
     }
 
-    free_kpages((vaddr_t)pmd);
-
-    return freed_pages;
+    list_add_tail(&kvaddr_to_page((vaddr_t)pmd)->buddy_list, &batch->pages);
 }
 
 /**
  * @brief Allocates a pte and it get assigned to the pmd table
  * 
- * @param pmd pmd table
+ * @param pt page table
  * @param addr address
  * @return int error value, if any
  */
-static int pmd_alloc_pte(pmd_t *pmd, vaddr_t addr)
+static int pmd_alloc_pte(struct page_table *pt, vaddr_t addr)
 {
     KASSERT(PMD_TABLE_PAGES == 1);
 
@@ -222,29 +303,30 @@ static int pmd_alloc_pte(pmd_t *pmd, vaddr_t addr)
     if (!pte)   
         return ENOMEM;
 
-    pmd_set_pte(&pmd[pmd_index(addr)], pte);
+    pmd_set_pte(pmd_offset(pt, addr), pte);
+    pt->table_pages += PTE_TABLE_PAGES;
 
     return 0;
 }
 
-static int pmd_alloc_page_range(pmd_t *pmd, vaddr_t start, vaddr_t end, struct pt_page_flags flags, size_t *alloc_pages)
+static int pmd_alloc_page_range(struct page_table *pt, vaddr_t start, vaddr_t end, struct pt_page_flags flags, size_t *alloc_pages)
 {
     int retval;
     vaddr_t next;
     pmd_t *pmd_entry;
     pte_t *pte;
 
-    KASSERT(pmd != NULL);
+    KASSERT(pt->pmd != NULL);
     KASSERT(alloc_pages != NULL);
     KASSERT(start <= end);
 
     do {
         next = pmd_addr_end(start, end);
 
-        pmd_entry = pmd_offset_pmd(pmd, start);
+        pmd_entry = pmd_offset(pt, start);
         /* allocate a new pte if not present */
         if (!pmd_present(*pmd_entry)) {
-            retval = pmd_alloc_pte(pmd, start);
+            retval = pmd_alloc_pte(pt, start);
             if (retval)
                 return retval;
         }
@@ -271,22 +353,38 @@ int pt_init(struct page_table *pt)
     KASSERT(pt != NULL);
 
     pt->total_pages = 0;
+    pt->swap_pages = 0;
 
     pt->pmd = pmd_create_table();
     if (!pt->pmd)
         return ENOMEM;
 
+    pt->table_pages = PMD_TABLE_PAGES;
+
     return 0;
 }
 
 void pt_destroy(struct page_table *pt)
 {
+    struct pt_free_batch batch = {
+        .pages = LIST_HEAD_INIT(batch.pages),
+        .nr_swap = 0,
+        .freed_pages = 0,
+        .freed_swap = 0,
+    };
+
     KASSERT(pt != NULL);
     KASSERT(pt->pmd != NULL);
 
-    pt->total_pages -= pmd_free_table(pt->pmd);
+    pmd_free_table(pt->pmd, &batch);
+    pt_free_batch_flush(&batch);
+
+    pt->total_pages -= batch.freed_pages;
+    pt->swap_pages -= batch.freed_swap;
+    pt->table_pages = 0;
 
     KASSERT(pt->total_pages == 0);
+    KASSERT(pt->swap_pages == 0);
 }
 
 /**
@@ -315,11 +413,166 @@ pte_t *pt_get_or_alloc_pte(struct page_table *pt, vaddr_t addr)
 
         /* assigns the PTE to a PMD entry */
         pmd_set_pte(pmd_entry, pte);
+        pt->table_pages += PTE_TABLE_PAGES;
     }
 
     return pte_offset(pmd_entry, addr);
 }
 
+/**
+ * @brief Account a `none` entry of a PTE table that
+ * has just been populated, either with a page or with
+ * a swap entry.
+ * 
+ * @param pte_entry entry returned by `pt_get_or_alloc_pte`
+ */
+void pt_pte_populated(pte_t *pte_entry)
+{
+    KASSERT(pte_entry != NULL);
+    KASSERT(!pte_none(*pte_entry));
+
+    pte_inc_populated(pte_entry, 1);
+}
+
+/**
+ * @brief Free the PTE table mapping `addr` if none
+ * of its entries is populated.
+ * 
+ * @param pt page table
+ * @param addr address mapped by the PTE table
+ * @return true if the table was freed
+ */
+bool pt_free_empty_pte(struct page_table *pt, vaddr_t addr)
+{
+    pmd_t *pmd_entry;
+    pte_t *pte;
+
+    KASSERT(pt != NULL);
+    KASSERT(pt->pmd != NULL);
+
+    pmd_entry = pmd_offset(pt, addr);
+    if (!pmd_present(*pmd_entry))
+        return false;
+
+    pte = pmd_ptetable(*pmd_entry);
+    if (pte_populated(pte) > 0)
+        return false;
+
+    pmd_clear(pmd_entry);
+    free_kpages((vaddr_t)pte);
+    pt->table_pages -= PTE_TABLE_PAGES;
+
+    return true;
+}
+
+/**
+ * @brief Clear a populated entry of the page table, the
+ * caller is in charge of the page or swap entry it was
+ * pointing to and may have already cleared the entry.
+ * If the PTE table becomes empty it is freed, so it must
+ * not be called from a `walk_ops_t`.
+ * 
+ * @param pt page table
+ * @param addr address of the entry
+ */
+void pt_clear_pte(struct page_table *pt, vaddr_t addr)
+{
+    pmd_t *pmd_entry;
+    pte_t *pte_entry;
+
+    KASSERT(pt != NULL);
+    KASSERT(pt->pmd != NULL);
+
+    pmd_entry = pmd_offset(pt, addr);
+    KASSERT(pmd_present(*pmd_entry));
+
+    pte_entry = pte_offset(pmd_entry, addr);
+    pte_clear(pte_entry);
+    pte_inc_populated(pte_entry, -1);
+
+    pt_free_empty_pte(pt, addr);
+}
+
+/**
+ * @brief Unmaps the entries of a PTE table between `start`
+ * and `end`, the freed frames and swap entries are queued
+ * on `batch`.
+ * 
+ * @param pte PTE table
+ * @param start first address, inside the table
+ * @param end end of the range
+ * @param batch teardown state
+ */
+static void pte_unmap_range(pte_t *pte, vaddr_t start, vaddr_t end, struct pt_free_batch *batch)
+{
+    size_t pmd_curr_index;
+    pte_t *pte_entry;
+
+    pt_for_each_pte_entry(pte, pte_entry, start, end, pmd_curr_index) {
+        if (pte_populated(pte) == 0)
+            break;
+
+        if (pte_none(*pte_entry))
+            continue;
+
+        pte_inc_populated(pte, -1);
+
+        if (pte_swap(*pte_entry)) {
+            pt_free_batch_add_swap(batch, pte_swap_entry(*pte_entry));
+            batch->freed_swap += 1;
+        } else {
+            KASSERT(pte_present(*pte_entry));
+            user_page_put_deferred(pte_page(*pte_entry), &batch->pages);
+            batch->freed_pages += 1;
+        }
+
+        pte_clear(pte_entry);
+    }
+}
+
+/**
+ * @brief Unmaps every page between `start` and `end`, the
+ * pages and swap entries are released and the PTE tables
+ * left empty are freed. The caller holds the page table
+ * lock and invalidates the TLB.
+ * 
+ * @param pt page table
+ * @param start first address of the range
+ * @param end end of the range
+ */
+void pt_unmap_range(struct page_table *pt, vaddr_t start, vaddr_t end)
+{
+    struct pt_free_batch batch = {
+        .pages = LIST_HEAD_INIT(batch.pages),
+        .nr_swap = 0,
+        .freed_pages = 0,
+        .freed_swap = 0,
+    };
+    vaddr_t next;
+    pmd_t *pmd_entry;
+
+    KASSERT(pt != NULL);
+    KASSERT(pt->pmd != NULL);
+    KASSERT(start <= end);
+
+    do {
+        next = pmd_addr_end(start, end);
+
+        pmd_entry = pmd_offset(pt, start);
+        if (!pmd_present(*pmd_entry))
+            continue;
+
+        pte_unmap_range(pmd_ptetable(*pmd_entry), start, next, &batch);
+        pt_free_empty_pte(pt, start);
+
+    } while (start = next, start < end);
+
+    pt_free_batch_flush(&batch);
+
+    pt->total_pages -= batch.freed_pages;
+    pt->swap_pages -= batch.freed_swap;
+}
+
 int pt_alloc_page(struct page_table *pt, vaddr_t addr, struct pt_page_flags flags, paddr_t *paddr)
 {
     pmd_t *pmd_entry;
@@ -342,6 +595,7 @@ int pt_alloc_page(struct page_table *pt, vaddr_t addr, struct pt_page_flags flag
 
         /* assigns the PTE to a PMD entry */
         pmd_set_pte(pmd_entry, pte);
+        pt->table_pages += PTE_TABLE_PAGES;
     } 
 
     pte_entry = pte_offset(pmd_entry, addr);
@@ -354,6 +608,7 @@ int pt_alloc_page(struct page_table *pt, vaddr_t addr, struct pt_page_flags flag
         pt->total_pages += 1;
 
         pte_set_page(pte_entry, page_to_kvaddr(page), page_flags);
+        pte_inc_populated(pte_entry, 1);
     } else {
         pte_clear_flags(pte_entry);
         pte_set_flags(pte_entry, page_flags);
@@ -384,7 +639,7 @@ int pt_alloc_page_range(struct page_table *pt, vaddr_t start, vaddr_t end, struc
     KASSERT(pt != NULL);
     KASSERT(pt->pmd != NULL);
 
-    retval = pmd_alloc_page_range(pt->pmd, start, end, flags, &alloc_pages);
+    retval = pmd_alloc_page_range(pt, start, end, flags, &alloc_pages);
     if (retval)
         return retval;
 
@@ -393,20 +648,33 @@ int pt_alloc_page_range(struct page_table *pt, vaddr_t start, vaddr_t end, struc
     return 0;
 }
 
-static walk_action_t pt_walk_pte(struct page_table *pt, pte_t *pte, vaddr_t start, vaddr_t end, walk_ops_t f)
+static walk_action_t pt_walk_pte(struct page_table *pt, pte_t *pte, vaddr_t start, vaddr_t end, walk_ops_t f, void *private)
 {
     size_t pmd_curr_index;
     pte_t *pte_entry;
     walk_action_t action = WALK_CONTINUE;
+    unsigned populated;
 
     KASSERT(pte != NULL);
     KASSERT(start <= end);
 
+    /*
+     * `f` can change an entry but not clear it,
+     * after the last populated entry there is
+     * nothing left to walk.
+     */
+    populated = pte_populated(pte);
+
     pt_for_each_pte_entry(pte, pte_entry, start, end, pmd_curr_index) {
+        if (populated == 0)
+            break;
+
         if (pte_none(*pte_entry))
             continue;
 
-        action = f(pt, pte_entry, start);
+        populated -= 1;
+
+        action = f(pt, pte_entry, start, private);
 
         if (action == WALK_BREAK)
             return WALK_BREAK;
@@ -415,7 +683,7 @@ static walk_action_t pt_walk_pte(struct page_table *pt, pte_t *pte, vaddr_t star
     return action;
 }
 
-int pt_walk_page_table(struct page_table *pt, vaddr_t start, vaddr_t end, walk_ops_t f)
+int pt_walk_page_table(struct page_table *pt, vaddr_t start, vaddr_t end, walk_ops_t f, void *private)
 {
     vaddr_t next;
     pmd_t *pmd_entry;
@@ -436,8 +704,10 @@ int pt_walk_page_table(struct page_table *pt, vaddr_t start, vaddr_t end, walk_o
             continue;
 
         pte = pmd_ptetable(*pmd_entry);
+        if (pte_populated(pte) == 0)
+            continue;
 
-        action = pt_walk_pte(pt, pte, start, end, f);
+        action = pt_walk_pte(pt, pte, start, end, f, private);
         if (action == WALK_BREAK)
             break;
 
@@ -490,25 +760,34 @@ int pt_copy(struct page_table *new, struct page_table *old)
     KASSERT(old->pmd != NULL);
     KASSERT(new->pmd != NULL);
     KASSERT(new->total_pages == 0);
+    KASSERT(new->swap_pages == 0);
 
     for (i = 0; i < PTRS_PER_PMD; i++) {
         if (!pmd_present(old->pmd[i]))
             continue;
 
+        old_pte = pmd_ptetable(old->pmd[i]);
+        if (pte_populated(old_pte) == 0)
+            continue;
+
         new_pte = pte_create_table();
         if (!new_pte)
             return ENOMEM;
 
         pmd_set_pte(&new->pmd[i], new_pte);
+        new->table_pages += PTE_TABLE_PAGES;
 
-        old_pte = pmd_ptetable(old->pmd[i]);
-        for (j = 0; j < PTRS_PER_PTE; j++) {
+        /* stop at the last populated entry */
+        for (j = 0; j < PTRS_PER_PTE && pte_populated(new_pte) < pte_populated(old_pte); j++) {
             if (pte_none(old_pte[j]))
                 continue;
 
+            pte_inc_populated(new_pte, 1);
+
             if (pte_swap(old_pte[j])) {
                 swap_inc_page(pte_swap_entry(old_pte[j]));
                 new_pte[j] = old_pte[j];
+                new->swap_pages += 1;
                 continue;
             }
 
@@ -526,6 +805,9 @@ int pt_copy(struct page_table *new, struct page_table *old)
     }
 
     KASSERT(new->total_pages == old->total_pages);
+    KASSERT(new->swap_pages == old->swap_pages);
     
     return 0;
 }
+
+#endif // !OPT_HASHPT
@@ -0,0 +1,296 @@
+#include <types.h>
+#include <lib.h>
+#include <list.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * List of all the caches that allocated at least one slab.
+ */
+static LIST_HEAD(cache_list);
+static struct spinlock cache_list_lock = SPINLOCK_INITIALIZER;
+
+/**
+ * @brief Header of a slab, it's placed at the
+ * beginning of the page, the objects follow it.
+ *
+ */
+struct slab {
+    struct list_head slab_list;     /* entry in one of the cache lists */
+    struct kmem_cache *cache;       /* owner of the slab */
+    void *freelist;                 /* first free object */
+    unsigned inuse;                 /* number of allocated objects */
+};
+
+#define SLAB_OBJS_OFFSET ROUNDUP(sizeof(struct slab), KMEM_CACHE_ALIGN)
+
+static inline unsigned slab_objects(struct kmem_cache *cache)
+{
+    return (PAGE_SIZE - SLAB_OBJS_OFFSET) / cache->size;
+}
+
+static inline void *slab_object(struct slab *slab, unsigned index)
+{
+    return (void *)((vaddr_t)slab + SLAB_OBJS_OFFSET + index * slab->cache->size);
+}
+
+static inline struct slab *obj_to_slab(void *obj)
+{
+    return (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+}
+
+static inline void *get_freepointer(struct kmem_cache *cache, void *obj)
+{
+    return *(void **)((vaddr_t)obj + cache->free_offset);
+}
+
+static inline void set_freepointer(struct kmem_cache *cache, void *obj, void *next)
+{
+    *(void **)((vaddr_t)obj + cache->free_offset) = next;
+}
+
+/**
+ * @brief Allocates a new slab for the cache and builds its
+ * free list, the constructor is called on every object.
+ *
+ * @param cache cache of the slab
+ * @return struct slab* the new slab or NULL if there is
+ * no memory available
+ */
+static struct slab *kmem_cache_grow(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    unsigned i, nobjs;
+    void *obj;
+
+    nobjs = slab_objects(cache);
+    KASSERT(nobjs > 0);
+
+    slab = (struct slab *)alloc_kpages(1);
+    if (!slab)
+        return NULL;
+
+    INIT_LIST_HEAD(&slab->slab_list);
+    slab->cache = cache;
+    slab->freelist = NULL;
+    slab->inuse = 0;
+
+    /* build the list backward, so the first object is the head */
+    for (i = nobjs; i > 0; i -= 1) {
+        obj = slab_object(slab, i - 1);
+
+        if (cache->ctor)
+            cache->ctor(obj);
+
+        set_freepointer(cache, obj, slab->freelist);
+        slab->freelist = obj;
+    }
+
+    return slab;
+}
+
+/**
+ * @brief Register the cache in the list of caches,
+ * only needed for the statistics.
+ *
+ * @param cache
+ */
+static void kmem_cache_register(struct kmem_cache *cache)
+{
+    spinlock_acquire(&cache_list_lock);
+    if (list_empty(&cache->cache_list))
+        list_add_tail(&cache->cache_list, &cache_list);
+    spinlock_release(&cache_list_lock);
+}
+
+/**
+ * @brief Allocates an object from the cache.
+ *
+ * @param cache cache to allocate from
+ * @return void* the object or NULL if no memory is available
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    struct slab *slab, *new_slab = NULL;
+    void *obj;
+
+    KASSERT(cache != NULL);
+
+    spinlock_acquire(&cache->cache_lock);
+
+    slab = list_first_entry_or_null(&cache->slabs_partial, struct slab, slab_list);
+    if (slab)
+        goto alloc_obj;
+
+    slab = list_first_entry_or_null(&cache->slabs_free, struct slab, slab_list);
+    if (slab) {
+        cache->nr_free_slabs -= 1;
+        list_move(&slab->slab_list, &cache->slabs_partial);
+        goto alloc_obj;
+    }
+
+    /* the page allocator can sleep, grow the cache unlocked */
+    spinlock_release(&cache->cache_lock);
+
+    new_slab = kmem_cache_grow(cache);
+    if (!new_slab)
+        return NULL;
+
+    kmem_cache_register(cache);
+
+    spinlock_acquire(&cache->cache_lock);
+
+    slab = new_slab;
+    cache->nr_slabs += 1;
+    list_add(&slab->slab_list, &cache->slabs_partial);
+
+alloc_obj:
+    KASSERT(slab->freelist != NULL);
+
+    obj = slab->freelist;
+    slab->freelist = get_freepointer(cache, obj);
+    slab->inuse += 1;
+    cache->nr_active += 1;
+
+    if (slab->inuse == slab_objects(cache))
+        list_move(&slab->slab_list, &cache->slabs_full);
+
+    spinlock_release(&cache->cache_lock);
+
+    return obj;
+}
+
+/**
+ * @brief Gives back an object to its cache. The slab is
+ * released to the page allocator when all of its objects
+ * are free and the cache already holds enough empty slabs.
+ *
+ * @param cache cache of the object
+ * @param obj object to free
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    struct slab *slab;
+    bool release = false;
+
+    KASSERT(cache != NULL);
+    KASSERT(obj != NULL);
+
+    slab = obj_to_slab(obj);
+    KASSERT(slab->cache == cache);
+
+    spinlock_acquire(&cache->cache_lock);
+
+    KASSERT(slab->inuse > 0);
+
+    set_freepointer(cache, obj, slab->freelist);
+    slab->freelist = obj;
+    cache->nr_active -= 1;
+
+    if (slab->inuse == slab_objects(cache))
+        list_move(&slab->slab_list, &cache->slabs_partial);
+
+    slab->inuse -= 1;
+
+    if (slab->inuse == 0) {
+        if (cache->nr_free_slabs < KMEM_CACHE_FREE_SLABS) {
+            cache->nr_free_slabs += 1;
+            list_move(&slab->slab_list, &cache->slabs_free);
+        } else {
+            cache->nr_slabs -= 1;
+            list_del_init(&slab->slab_list);
+            release = true;
+        }
+    }
+
+    spinlock_release(&cache->cache_lock);
+
+    if (release)
+        free_kpages((vaddr_t)slab);
+}
+
+/**
+ * @brief Releases all the empty slabs of the cache
+ * to the page allocator.
+ *
+ * @param cache cache to shrink
+ * @return unsigned number of pages released
+ */
+unsigned kmem_cache_shrink(struct kmem_cache *cache)
+{
+    LIST_HEAD(free_slabs);
+    struct slab *slab, *tmp;
+    unsigned nfreed = 0;
+
+    KASSERT(cache != NULL);
+
+    spinlock_acquire(&cache->cache_lock);
+
+    list_splice_init(&cache->slabs_free, &free_slabs);
+    cache->nr_slabs -= cache->nr_free_slabs;
+    cache->nr_free_slabs = 0;
+
+    spinlock_release(&cache->cache_lock);
+
+    list_for_each_entry_safe(slab, tmp, &free_slabs, slab_list) {
+        KASSERT(slab->inuse == 0);
+        list_del_init(&slab->slab_list);
+        free_kpages((vaddr_t)slab);
+        nfreed += 1;
+    }
+
+    return nfreed;
+}
+
+/**
+ * @brief Shrinks every registered cache.
+ *
+ * @return unsigned number of pages released
+ */
+unsigned kmem_cache_shrink_all(void)
+{
+    struct kmem_cache *cache;
+    unsigned nfreed = 0;
+
+    spinlock_acquire(&cache_list_lock);
+
+    list_for_each_entry(cache, &cache_list, cache_list) {
+        nfreed += kmem_cache_shrink(cache);
+    }
+
+    spinlock_release(&cache_list_lock);
+
+    return nfreed;
+}
+
+/**
+ * @brief Prints the usage of every cache.
+ *
+ */
+void kmem_cache_print_info(void)
+{
+    struct kmem_cache *cache;
+
+    kprintf("Slab caches info:\n");
+    kprintf("%-24s %8s %8s %8s %8s %8s\n",
+            "name", "objsize", "slotsize", "active", "total", "slabs");
+
+    spinlock_acquire(&cache_list_lock);
+
+    list_for_each_entry(cache, &cache_list, cache_list) {
+        spinlock_acquire(&cache->cache_lock);
+
+        kprintf("%-24s %8u %8u %8u %8u %8u\n",
+                cache->name,
+                cache->object_size,
+                cache->size,
+                cache->nr_active,
+                cache->nr_slabs * slab_objects(cache),
+                cache->nr_slabs);
+
+        spinlock_release(&cache->cache_lock);
+    }
+
+    spinlock_release(&cache_list_lock);
+}
@@ -58,6 +58,38 @@ static int __must_check handle_swap_dec_page(struct swap_memory *swap, swap_entr
     return valid ? 0 : EINVAL;
 }
 
+/**
+ * @brief Decrement the counter of a batch of entries
+ * taking the swap lock once.
+ * 
+ * @return int EINVAL if at least one entry was not in use
+ */
+static int __must_check handle_swap_dec_pages(struct swap_memory *swap, const swap_entry_t *entries, size_t nentries)
+{
+    bool valid = true;
+    size_t i, index;
+
+    spinlock_acquire(&swap->swap_lock);
+    for (i = 0; i < nentries; i++) {
+        KASSERT(PAGE_ALIGNED(entries[i].val));
+
+        index = entries[i].val / PAGE_SIZE;
+
+        if (swap->swap_page_list[index].refcount == 0) {
+            valid = false;
+            continue;
+        }
+
+        swap->swap_page_list[index].refcount -= 1;
+
+        if (swap->swap_page_list[index].refcount == 0)
+            swap->swap_pages -= 1;
+    }
+    spinlock_release(&swap->swap_lock);
+
+    return valid ? 0 : EINVAL;
+}
+
 /**
  * @brief Check if a page can be move to the
  * swap memory.
@@ -79,8 +111,17 @@ static bool swap_check_page(struct page *page)
     return true;
 }
 
+/**
+ * @brief Find the first free entry of the swap memory.
+ * 
+ * @param swap swap memory
+ * @return size_t index of the entry or SWAP_ENTRIES if
+ * the swap memory is full
+ */
 static size_t swap_get_first_free(struct swap_memory *swap)
 {
+    KASSERT(spinlock_do_i_hold(&swap->swap_lock));
+
     for (size_t i = 0; i < SWAP_ENTRIES; i += 1) {
         if (swap->swap_page_list[i].refcount != 0)
             continue;
@@ -88,7 +129,7 @@ static size_t swap_get_first_free(struct swap_memory *swap)
         return i;
     }
 
-    panic("Out of swap space!\n");
+    return SWAP_ENTRIES;
 }
 
 static int handle_swap_add_page(struct swap_memory *swap, struct page *page, swap_entry_t *entry)
@@ -110,6 +151,11 @@ static int handle_swap_add_page(struct swap_memory *swap, struct page *page, swa
     spinlock_acquire(&swap->swap_lock);
 
     first_free = swap_get_first_free(swap);
+    if (first_free == SWAP_ENTRIES) {
+        spinlock_release(&swap->swap_lock);
+        lock_release(swap->swap_file_lock);
+        return ENOSPC;
+    }
 
     swap->swap_page_list[first_free].refcount += 1;
     swap->swap_pages += 1;
@@ -356,3 +402,16 @@ int swap_dec_page(swap_entry_t entry)
 {
     return handle_swap_dec_page(&swap_mem, entry);
 }
+
+/**
+ * @brief Same as swap_dec_page() for an array of entries,
+ * used when a whole page table is torn down.
+ * 
+ * @param entries entries to decrement
+ * @param nentries number of entries
+ * @return error if one of the entries doesn't exist
+ */
+int swap_dec_pages(const swap_entry_t *entries, size_t nentries)
+{
+    return handle_swap_dec_pages(&swap_mem, entries, nentries);
+}
@@ -10,6 +10,7 @@
 #include <vm_tlb.h>
 #include <spinlock.h>
 #include <fault_stat.h>
+#include <cpu.h>
 #include <machine/tlb.h>
 
 
@@ -159,3 +160,138 @@ void vm_tlb_flush_one(vaddr_t addr)
 	splx(spl);
 	spinlock_release(&tlb_lock);
 }
+
+/**
+ * @brief Handles a TLB shootdown sent by another CPU,
+ * called from interprocessor_interrupt.
+ * 
+ * @param ts shootdown request
+ */
+void vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	if (ts->ts_vaddr == 0)
+		vm_tlb_flush();
+	else
+		vm_tlb_flush_one(ts->ts_vaddr);
+
+	atomic_add(ts->ts_done, 1);
+}
+
+/**
+ * @brief Invalidates one entry of the TLB on every CPU,
+ * returns only once all the CPUs have dropped the entry.
+ * The caller must not hold any spinlock, the other CPUs
+ * could be waiting on it with interrupts disabled.
+ * 
+ * @param addr virtual address to invalidate, 0 flushes
+ * the whole TLB
+ */
+void vm_tlb_shootdown(vaddr_t addr)
+{
+	atomic_t done = ATOMIC_INIT(0);
+	struct tlbshootdown ts = {
+		.ts_vaddr = addr & TLBHI_VPAGE,
+		.ts_done = &done,
+	};
+	unsigned sent;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	if (ts.ts_vaddr == 0)
+		vm_tlb_flush();
+	else
+		vm_tlb_flush_one(ts.ts_vaddr);
+
+	sent = ipi_tlbshootdown_broadcast(&ts);
+
+	while ((unsigned)atomic_read(&done) < sent)
+		;
+}
+
+/**
+ * @brief Invalidates one entry in every TLB the address space
+ * of the current process could be loaded in: the local one
+ * for a single threaded process, every CPU otherwise.
+ * The caller must not hold any spinlock.
+ * 
+ * @param addr virtual address to invalidate, 0 flushes
+ * the whole TLB
+ */
+void vm_tlb_invalidate(vaddr_t addr)
+{
+	if (curproc && proc_multithreaded(curproc))
+		vm_tlb_shootdown(addr);
+	else if (addr == 0)
+		vm_tlb_flush();
+	else
+		vm_tlb_flush_one(addr);
+}
+
+/**
+ * @brief Adds a page to the batch of entries to invalidate,
+ * the entry is dropped only by vm_tlb_batch_flush().
+ * 
+ * @param batch batch to add the page to
+ * @param addr virtual address to invalidate
+ * @param remote the address space could be active on another cpu
+ */
+void vm_tlb_batch_add(struct tlb_batch *batch, vaddr_t addr, bool remote)
+{
+	batch->remote |= remote;
+
+	if (batch->full)
+		return;
+
+	if (batch->nr == TLB_BATCH_MAX) {
+		batch->full = true;
+		return;
+	}
+
+	batch->addrs[batch->nr++] = addr & TLBHI_VPAGE;
+}
+
+/**
+ * @brief Invalidates all the entries of the batch, taking
+ * the TLB lock once. A large batch flushes the whole TLB.
+ * When the batch is remote, the other CPUs get a single
+ * shootdown: selective for one page, a full flush otherwise,
+ * the shootdown queue of a CPU is only TLBSHOOTDOWN_MAX deep.
+ * The caller must not hold any spinlock.
+ * 
+ * @param batch batch to flush, empty on return
+ */
+void vm_tlb_batch_flush(struct tlb_batch *batch)
+{
+	unsigned i;
+	int spl;
+	int index;
+
+	if (batch->nr == 0 && !batch->full)
+		return;
+
+	if (batch->remote) {
+		vm_tlb_shootdown(!batch->full && batch->nr == 1 ? batch->addrs[0] : 0);
+		goto out;
+	}
+
+	if (batch->full) {
+		vm_tlb_flush();
+		goto out;
+	}
+
+	spinlock_acquire(&tlb_lock);
+	spl = splhigh();
+
+	for (i = 0; i < batch->nr; i++) {
+		index = tlb_probe(batch->addrs[i], 0);
+
+		if (index >= 0)
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+
+	splx(spl);
+	spinlock_release(&tlb_lock);
+
+out:
+	*batch = TLB_BATCH_INIT;
+}
@@ -0,0 +1,159 @@
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <rwonce.h>
+#include <addrspace.h>
+#include <pt.h>
+#include <vm_tlb.h>
+#include <wss.h>
+
+
+/*
+ * Hardclocks between two samples of the
+ * referenced bits, half a second.
+ */
+#define WSS_SAMPLE_HARDCLOCKS   (HZ / 2)
+
+/*
+ * Woken up by the hardclock of cpu 0 once
+ * every sampling period.
+ */
+static struct semaphore *wss_sem = NULL;
+static bool wss_pending = false;
+
+/*
+ * Statistics.
+ */
+static unsigned wss_samples = 0;
+static unsigned wss_skipped = 0;
+
+/*
+ * State of the sample of one address space.
+ */
+struct wss_sample {
+    size_t referenced;          /* pages with the accessed bit set */
+    struct tlb_batch tlb;       /* entries whose accessed bit was cleared */
+};
+
+static walk_action_t wss_sample_pte(struct page_table *pt, pte_t *pte, vaddr_t page_addr, void *private)
+{
+    struct wss_sample *sample = private;
+
+    (void)pt;
+
+    if (!pte_present(*pte) || pte_swap(*pte))
+        return WALK_CONTINUE;
+
+    if (!pte_accessed(*pte))
+        return WALK_CONTINUE;
+
+    sample->referenced += 1;
+
+    /* the next access reloads the TLB and sets the bit again */
+    pte_clear_accessed(pte);
+    vm_tlb_batch_add(&sample->tlb, page_addr, true);
+
+    return WALK_CONTINUE;
+}
+
+/**
+ * @brief Samples the pages referenced by `as` since the
+ * last period and updates its working set estimate and
+ * page fault frequency.
+ *
+ */
+static void wss_sample_as(struct addrspace *as, void *private)
+{
+    struct wss_sample sample = {
+        .referenced = 0,
+        .tlb = TLB_BATCH_INIT,
+    };
+
+    (void)private;
+
+    pt_walk_page_table(&as->pt, 0, USERSPACETOP, wss_sample_pte, &sample);
+    vm_tlb_batch_flush(&sample.tlb);
+
+    /* exponential average, half of the weight to the last sample */
+    as->wss_pages = (as->wss_pages + sample.referenced + 1) / 2;
+
+    as->pff = as->nr_faults;
+    as->nr_faults = 0;
+}
+
+static void wss_thread(void *ign, unsigned long ign2)
+{
+    (void)ign;
+    (void)ign2;
+
+    for (;;) {
+        P(wss_sem);
+
+        if (as_for_each(wss_sample_as, NULL) == 0)
+            wss_samples += 1;
+        else
+            wss_skipped += 1;
+
+        WRITE_ONCE(wss_pending, false);
+    }
+}
+
+/**
+ * @brief Called on every hardclock, wakes up the sampler
+ * once every period. Only cpu 0 keeps the time.
+ *
+ */
+void wss_hardclock(void)
+{
+    if (wss_sem == NULL || curcpu->c_number != 0)
+        return;
+
+    if ((curcpu->c_hardclocks % WSS_SAMPLE_HARDCLOCKS) != 0)
+        return;
+
+    /* the previous sample is not over yet */
+    if (READ_ONCE(wss_pending))
+        return;
+
+    WRITE_ONCE(wss_pending, true);
+    V(wss_sem);
+}
+
+/**
+ * @brief Starts the kernel thread that estimates the
+ * working set of the address spaces.
+ *
+ */
+void wss_bootstrap(void)
+{
+    struct semaphore *sem;
+    int retval;
+
+    sem = sem_create("wss_sem", 0);
+    if (!sem)
+        panic("wss_bootstrap: could not create wss_sem\n");
+
+    retval = thread_fork("wssd", NULL, wss_thread, NULL, 0);
+    if (retval)
+        panic("wss_bootstrap: could not start wssd: %s\n", strerror(retval));
+
+    /* publish the semaphore last, the hardclock checks it */
+    WRITE_ONCE(wss_sem, sem);
+}
+
+/**
+ * @brief Prints the statistics of the sampler, the per
+ * process estimates are printed by proc_print_mem_info().
+ *
+ */
+void wss_print_info(void)
+{
+    kprintf("Working set sampler info:\n");
+    kprintf("period (hardclocks):\t%8u\n", WSS_SAMPLE_HARDCLOCKS);
+    kprintf("samples:\t\t%8u\n", wss_samples);
+    kprintf("skipped samples:\t%8u\n", wss_skipped);
+}